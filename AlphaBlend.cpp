@@ -1,4 +1,17 @@
 #include "AlphaBlend.h"
+#include "cpu.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(EUCLASE_X86)
+#include <immintrin.h>
+#endif
+
+// AVX-512 を有効にした関数では GCC が乗算と加算を FMA にまとめてしまい、
+// 丸めが変わって命令セットごとに結果が 1 ずれることがあるので、まとめさせない
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
 
 //AlphaBlend::AlphaBlend()
 //{
@@ -8,14 +21,917 @@
 
 
 
-int16_t AlphaBlend::fixed_t::lut_mul_[65536] = {1};
+const int AlphaBlend::fixed_t::BITS;
+const int32_t AlphaBlend::fixed_t::ONE;
+const int AlphaBlend::fixed_t::GAMMA_SHIFT;
+uint32_t AlphaBlend::fixed_t::degamma_lut_[256];
+uint32_t AlphaBlend::fixed_t::threshold_[257];
+uint8_t AlphaBlend::fixed_t::gamma_lut_[(ONE >> GAMMA_SHIFT) + 1];
+
+// どのテーブルも整数演算だけで作る
+struct AlphaBlend::fixed_t::Tables {
+	Tables()
+	{
+		// degamma_lut_[v] = round((v / 255)^2 * ONE)
+		for (int v = 0; v < 256; v++) {
+			degamma_lut_[v] = (uint32_t)(((int64_t)v * v * ONE + 65025 / 2) / 65025);
+		}
+		// gamma8() は floor(255 * sqrt(x / ONE) + 0.5)
+		// k - 0.5 <= 255 * sqrt(x / ONE) <=> (2k - 1)^2 * ONE <= 4 * 255^2 * x
+		threshold_[0] = 0;
+		for (int k = 1; k < 256; k++) {
+			const int64_t t = (int64_t)(2 * k - 1) * (2 * k - 1) * ONE;
+			threshold_[k] = (uint32_t)((t + 4 * 65025 - 1) / (4 * 65025));
+		}
+		threshold_[256] = UINT32_MAX;
+		int k = 0;
+		for (int i = 0; i <= (ONE >> GAMMA_SHIFT); i++) {
+			const uint32_t x = (uint32_t)i << GAMMA_SHIFT;
+			while (k < 255 && x >= threshold_[k + 1]) k++;
+			gamma_lut_[i] = k;
+		}
+	}
+};
+
+AlphaBlend::fixed_t::Tables AlphaBlend::fixed_t::tables_;
+
+// スパン合成カーネル
+// どの版もスカラー版 blend_with_gamma_collection(base, over) と同じ順序で演算する。
+// 8bit への変換は floor(x * 255 + 0.5) を「切り捨て + 端数 >= 0.5」で再現している。
+
+namespace {
+
+using PixelRGBA = euclase::PixelRGBA;
+
+inline uint8_t mask_alpha(uint8_t a, uint8_t m)
+{
+	int x = a * m;
+	return (x + 1 + (x >> 8)) >> 8; // == x / 255 (0 <= x <= 255 * 255)
+}
+
+// ポータブル版（NEON などでは自動ベクトル化に任せる）
+template <int N> void blend_lanes(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk)
+{
+	float br[N], bg[N], bb[N], ba[N];
+	float or_[N], og[N], ob[N], oa[N];
+	for (int i = 0; i < N; i++) {
+		uint8_t a = msk ? mask_alpha(src[i].a, msk[i]) : src[i].a;
+		br[i] = dst[i].r / 255.0f;
+		bg[i] = dst[i].g / 255.0f;
+		bb[i] = dst[i].b / 255.0f;
+		ba[i] = dst[i].a / 255.0f;
+		or_[i] = src[i].r / 255.0f;
+		og[i] = src[i].g / 255.0f;
+		ob[i] = src[i].b / 255.0f;
+		oa[i] = a / 255.0f;
+	}
+	for (int i = 0; i < N; i++) {
+		br[i] *= br[i];
+		bg[i] *= bg[i];
+		bb[i] *= bb[i];
+		or_[i] *= or_[i];
+		og[i] *= og[i];
+		ob[i] *= ob[i];
+	}
+	for (int i = 0; i < N; i++) {
+		float r, g, b, a;
+		if (oa[i] <= 0) {
+			r = br[i];
+			g = bg[i];
+			b = bb[i];
+			a = ba[i];
+		} else if (ba[i] <= 0 || oa[i] >= 1) {
+			r = or_[i];
+			g = og[i];
+			b = ob[i];
+			a = oa[i];
+		} else {
+			float inv = 1 - oa[i];
+			a = oa[i] + ba[i] * inv;
+			r = (or_[i] * oa[i] + br[i] * ba[i] * inv) / a;
+			g = (og[i] * oa[i] + bg[i] * ba[i] * inv) / a;
+			b = (ob[i] * oa[i] + bb[i] * ba[i] * inv) / a;
+		}
+		dst[i] = euclase::FPixelRGBA(std::sqrt(r), std::sqrt(g), std::sqrt(b), a);
+	}
+}
+
+int blend_span_portable(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		blend_lanes<4>(dst + i, src + i, msk ? msk + i : nullptr);
+	}
+	return i;
+}
+
+#if defined(EUCLASE_X86)
+
+// SSE2
+
+EUCLASE_TARGET("sse2") inline __m128 load_channel(__m128i v, int shift)
+{
+	__m128i c = _mm_and_si128(_mm_srli_epi32(v, shift), _mm_set1_epi32(0xff));
+	return _mm_div_ps(_mm_cvtepi32_ps(c), _mm_set1_ps(255.0f));
+}
+
+EUCLASE_TARGET("sse2") inline __m128 select(__m128 cond, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(cond, a), _mm_andnot_ps(cond, b));
+}
+
+EUCLASE_TARGET("sse2") inline __m128i store_channel(__m128 v)
+{
+	v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+	v = _mm_mul_ps(v, _mm_set1_ps(255.0f));
+	__m128i t = _mm_cvttps_epi32(v);
+	__m128 frac = _mm_sub_ps(v, _mm_cvtepi32_ps(t));
+	__m128i up = _mm_castps_si128(_mm_cmpge_ps(frac, _mm_set1_ps(0.5f)));
+	return _mm_sub_epi32(t, up); // up は -1
+}
+
+EUCLASE_TARGET("sse2") inline void blend4(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk)
+{
+	__m128i d = _mm_loadu_si128(reinterpret_cast<__m128i const *>(dst));
+	__m128i s = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src));
+	__m128i sa = _mm_srli_epi32(s, 24);
+	if (msk) {
+		int32_t m;
+		memcpy(&m, msk, 4);
+		__m128i zero = _mm_setzero_si128();
+		__m128i mm = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(m), zero), zero);
+		__m128i x = _mm_mullo_epi16(sa, mm);
+		sa = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, _mm_set1_epi32(1)), _mm_srli_epi32(x, 8)), 8);
+	}
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 zero = _mm_setzero_ps();
+	__m128 br = load_channel(d, 0);
+	__m128 bg = load_channel(d, 8);
+	__m128 bb = load_channel(d, 16);
+	__m128 ba = load_channel(d, 24);
+	__m128 or_ = load_channel(s, 0);
+	__m128 og = load_channel(s, 8);
+	__m128 ob = load_channel(s, 16);
+	__m128 oa = _mm_div_ps(_mm_cvtepi32_ps(sa), _mm_set1_ps(255.0f));
+	br = _mm_mul_ps(br, br);
+	bg = _mm_mul_ps(bg, bg);
+	bb = _mm_mul_ps(bb, bb);
+	or_ = _mm_mul_ps(or_, or_);
+	og = _mm_mul_ps(og, og);
+	ob = _mm_mul_ps(ob, ob);
+
+	__m128 inv = _mm_sub_ps(one, oa);
+	__m128 a = _mm_add_ps(oa, _mm_mul_ps(ba, inv));
+	__m128 r = _mm_div_ps(_mm_add_ps(_mm_mul_ps(or_, oa), _mm_mul_ps(_mm_mul_ps(br, ba), inv)), a);
+	__m128 g = _mm_div_ps(_mm_add_ps(_mm_mul_ps(og, oa), _mm_mul_ps(_mm_mul_ps(bg, ba), inv)), a);
+	__m128 b = _mm_div_ps(_mm_add_ps(_mm_mul_ps(ob, oa), _mm_mul_ps(_mm_mul_ps(bb, ba), inv)), a);
+
+	__m128 use_over = _mm_or_ps(_mm_cmple_ps(ba, zero), _mm_cmpge_ps(oa, one));
+	r = select(use_over, or_, r);
+	g = select(use_over, og, g);
+	b = select(use_over, ob, b);
+	a = select(use_over, oa, a);
+	__m128 use_base = _mm_cmple_ps(oa, zero);
+	r = select(use_base, br, r);
+	g = select(use_base, bg, g);
+	b = select(use_base, bb, b);
+	a = select(use_base, ba, a);
+
+	__m128i v = store_channel(_mm_sqrt_ps(r));
+	v = _mm_or_si128(v, _mm_slli_epi32(store_channel(_mm_sqrt_ps(g)), 8));
+	v = _mm_or_si128(v, _mm_slli_epi32(store_channel(_mm_sqrt_ps(b)), 16));
+	v = _mm_or_si128(v, _mm_slli_epi32(store_channel(a), 24));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst), v);
+}
+
+// AVX2
+
+EUCLASE_TARGET("avx2") inline __m256 load_channel(__m256i v, int shift)
+{
+	__m256i c = _mm256_and_si256(_mm256_srli_epi32(v, shift), _mm256_set1_epi32(0xff));
+	return _mm256_div_ps(_mm256_cvtepi32_ps(c), _mm256_set1_ps(255.0f));
+}
+
+EUCLASE_TARGET("avx2") inline __m256i store_channel(__m256 v)
+{
+	v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+	v = _mm256_mul_ps(v, _mm256_set1_ps(255.0f));
+	__m256i t = _mm256_cvttps_epi32(v);
+	__m256 frac = _mm256_sub_ps(v, _mm256_cvtepi32_ps(t));
+	__m256i up = _mm256_castps_si256(_mm256_cmp_ps(frac, _mm256_set1_ps(0.5f), _CMP_GE_OQ));
+	return _mm256_sub_epi32(t, up); // up は -1
+}
+
+EUCLASE_TARGET("avx2") inline void blend8(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk)
+{
+	__m256i d = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(dst));
+	__m256i s = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(src));
+	__m256i sa = _mm256_srli_epi32(s, 24);
+	if (msk) {
+		__m256i mm = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(msk)));
+		__m256i x = _mm256_mullo_epi16(sa, mm);
+		sa = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(x, _mm256_set1_epi32(1)), _mm256_srli_epi32(x, 8)), 8);
+	}
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 zero = _mm256_setzero_ps();
+	__m256 br = load_channel(d, 0);
+	__m256 bg = load_channel(d, 8);
+	__m256 bb = load_channel(d, 16);
+	__m256 ba = load_channel(d, 24);
+	__m256 or_ = load_channel(s, 0);
+	__m256 og = load_channel(s, 8);
+	__m256 ob = load_channel(s, 16);
+	__m256 oa = _mm256_div_ps(_mm256_cvtepi32_ps(sa), _mm256_set1_ps(255.0f));
+	br = _mm256_mul_ps(br, br);
+	bg = _mm256_mul_ps(bg, bg);
+	bb = _mm256_mul_ps(bb, bb);
+	or_ = _mm256_mul_ps(or_, or_);
+	og = _mm256_mul_ps(og, og);
+	ob = _mm256_mul_ps(ob, ob);
+
+	__m256 inv = _mm256_sub_ps(one, oa);
+	__m256 a = _mm256_add_ps(oa, _mm256_mul_ps(ba, inv));
+	__m256 r = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(or_, oa), _mm256_mul_ps(_mm256_mul_ps(br, ba), inv)), a);
+	__m256 g = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(og, oa), _mm256_mul_ps(_mm256_mul_ps(bg, ba), inv)), a);
+	__m256 b = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(ob, oa), _mm256_mul_ps(_mm256_mul_ps(bb, ba), inv)), a);
+
+	__m256 use_over = _mm256_or_ps(_mm256_cmp_ps(ba, zero, _CMP_LE_OQ), _mm256_cmp_ps(oa, one, _CMP_GE_OQ));
+	r = _mm256_blendv_ps(r, or_, use_over);
+	g = _mm256_blendv_ps(g, og, use_over);
+	b = _mm256_blendv_ps(b, ob, use_over);
+	a = _mm256_blendv_ps(a, oa, use_over);
+	__m256 use_base = _mm256_cmp_ps(oa, zero, _CMP_LE_OQ);
+	r = _mm256_blendv_ps(r, br, use_base);
+	g = _mm256_blendv_ps(g, bg, use_base);
+	b = _mm256_blendv_ps(b, bb, use_base);
+	a = _mm256_blendv_ps(a, ba, use_base);
+
+	__m256i v = store_channel(_mm256_sqrt_ps(r));
+	v = _mm256_or_si256(v, _mm256_slli_epi32(store_channel(_mm256_sqrt_ps(g)), 8));
+	v = _mm256_or_si256(v, _mm256_slli_epi32(store_channel(_mm256_sqrt_ps(b)), 16));
+	v = _mm256_or_si256(v, _mm256_slli_epi32(store_channel(a), 24));
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), v);
+}
+
+// AVX-512（F だけを使う）
+// GCC 12 では、マスクなしの組み込み関数の多くが _mm512_undefined_*() を素通しの値に使うため、
+// 展開先で -Wmaybe-uninitialized が出る。全レーンを選ぶ maskz_ 版（ゼロから始める）を使う
+
+const __mmask16 ALL_LANES = 0xffff;
+
+EUCLASE_TARGET("avx512f") inline __m512 load_channel(__m512i v, int shift)
+{
+	__m512i c = _mm512_and_si512(_mm512_maskz_srli_epi32(ALL_LANES, v, shift), _mm512_set1_epi32(0xff));
+	return _mm512_div_ps(_mm512_maskz_cvtepi32_ps(ALL_LANES, c), _mm512_set1_ps(255.0f));
+}
+
+EUCLASE_TARGET("avx512f") inline __m512i store_channel(__m512 v)
+{
+	v = _mm512_maskz_min_ps(ALL_LANES, _mm512_maskz_max_ps(ALL_LANES, v, _mm512_setzero_ps()), _mm512_set1_ps(1.0f));
+	v = _mm512_mul_ps(v, _mm512_set1_ps(255.0f));
+	__m512i t = _mm512_maskz_cvttps_epi32(ALL_LANES, v);
+	__m512 frac = _mm512_sub_ps(v, _mm512_maskz_cvtepi32_ps(ALL_LANES, t));
+	__mmask16 up = _mm512_cmp_ps_mask(frac, _mm512_set1_ps(0.5f), _CMP_GE_OQ);
+	return _mm512_mask_add_epi32(t, up, t, _mm512_set1_epi32(1));
+}
+
+EUCLASE_TARGET("avx512f") inline void blend16(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk)
+{
+	__m512i d = _mm512_loadu_si512(dst);
+	__m512i s = _mm512_loadu_si512(src);
+	__m512i sa = _mm512_maskz_srli_epi32(ALL_LANES, s, 24);
+	if (msk) {
+		__m512i mm = _mm512_maskz_cvtepu8_epi32(ALL_LANES, _mm_loadu_si128(reinterpret_cast<__m128i const *>(msk)));
+		__m512i x = _mm512_mullo_epi32(sa, mm);
+		sa = _mm512_maskz_srli_epi32(ALL_LANES, _mm512_add_epi32(_mm512_add_epi32(x, _mm512_set1_epi32(1)), _mm512_maskz_srli_epi32(ALL_LANES, x, 8)), 8);
+	}
+	const __m512 one = _mm512_set1_ps(1.0f);
+	const __m512 zero = _mm512_setzero_ps();
+	__m512 br = load_channel(d, 0);
+	__m512 bg = load_channel(d, 8);
+	__m512 bb = load_channel(d, 16);
+	__m512 ba = load_channel(d, 24);
+	__m512 or_ = load_channel(s, 0);
+	__m512 og = load_channel(s, 8);
+	__m512 ob = load_channel(s, 16);
+	__m512 oa = _mm512_div_ps(_mm512_maskz_cvtepi32_ps(ALL_LANES, sa), _mm512_set1_ps(255.0f));
+	br = _mm512_mul_ps(br, br);
+	bg = _mm512_mul_ps(bg, bg);
+	bb = _mm512_mul_ps(bb, bb);
+	or_ = _mm512_mul_ps(or_, or_);
+	og = _mm512_mul_ps(og, og);
+	ob = _mm512_mul_ps(ob, ob);
+
+	__m512 inv = _mm512_sub_ps(one, oa);
+	__m512 a = _mm512_add_ps(oa, _mm512_mul_ps(ba, inv));
+	__m512 r = _mm512_div_ps(_mm512_add_ps(_mm512_mul_ps(or_, oa), _mm512_mul_ps(_mm512_mul_ps(br, ba), inv)), a);
+	__m512 g = _mm512_div_ps(_mm512_add_ps(_mm512_mul_ps(og, oa), _mm512_mul_ps(_mm512_mul_ps(bg, ba), inv)), a);
+	__m512 b = _mm512_div_ps(_mm512_add_ps(_mm512_mul_ps(ob, oa), _mm512_mul_ps(_mm512_mul_ps(bb, ba), inv)), a);
+
+	__mmask16 use_over = _mm512_cmp_ps_mask(ba, zero, _CMP_LE_OQ) | _mm512_cmp_ps_mask(oa, one, _CMP_GE_OQ);
+	r = _mm512_mask_blend_ps(use_over, r, or_);
+	g = _mm512_mask_blend_ps(use_over, g, og);
+	b = _mm512_mask_blend_ps(use_over, b, ob);
+	a = _mm512_mask_blend_ps(use_over, a, oa);
+	__mmask16 use_base = _mm512_cmp_ps_mask(oa, zero, _CMP_LE_OQ);
+	r = _mm512_mask_blend_ps(use_base, r, br);
+	g = _mm512_mask_blend_ps(use_base, g, bg);
+	b = _mm512_mask_blend_ps(use_base, b, bb);
+	a = _mm512_mask_blend_ps(use_base, a, ba);
+
+	__m512i v = store_channel(_mm512_maskz_sqrt_ps(ALL_LANES, r));
+	v = _mm512_or_si512(v, _mm512_maskz_slli_epi32(ALL_LANES, store_channel(_mm512_maskz_sqrt_ps(ALL_LANES, g)), 8));
+	v = _mm512_or_si512(v, _mm512_maskz_slli_epi32(ALL_LANES, store_channel(_mm512_maskz_sqrt_ps(ALL_LANES, b)), 16));
+	v = _mm512_or_si512(v, _mm512_maskz_slli_epi32(ALL_LANES, store_channel(a), 24));
+	_mm512_storeu_si512(dst, v);
+}
+
+// スパン単位のカーネル。処理した画素数を返し、端数は呼び出し側が1画素ずつ処理する
+
+EUCLASE_TARGET("sse2") int blend_span_sse2(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		blend4(dst + i, src + i, msk ? msk + i : nullptr);
+	}
+	return i;
+}
+
+EUCLASE_TARGET("avx2") int blend_span_avx2(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk, int n)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		blend8(dst + i, src + i, msk ? msk + i : nullptr);
+	}
+	return i;
+}
+
+EUCLASE_TARGET("avx512f") int blend_span_avx512(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk, int n)
+{
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		blend16(dst + i, src + i, msk ? msk + i : nullptr);
+	}
+	return i;
+}
+
+// 乗算済みリニアの蓄積値 -> 8bit
+// store_channel(sqrt(x)) は gamma8(x) と、store_channel(x) は unorm8(x) と同じ値になる
+
+EUCLASE_TARGET("sse2") inline __m128i pack_rgba(__m128 r, __m128 g, __m128 b, __m128 a)
+{
+	__m128i v = store_channel(_mm_sqrt_ps(r));
+	v = _mm_or_si128(v, _mm_slli_epi32(store_channel(_mm_sqrt_ps(g)), 8));
+	v = _mm_or_si128(v, _mm_slli_epi32(store_channel(_mm_sqrt_ps(b)), 16));
+	return _mm_or_si128(v, _mm_slli_epi32(store_channel(a), 24));
+}
+
+EUCLASE_TARGET("sse2") int store_span_sse2(PixelRGBA *dst, float const *acc, int n, bool straight)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 r = _mm_loadu_ps(acc + i * 4);
+		__m128 g = _mm_loadu_ps(acc + i * 4 + 4);
+		__m128 b = _mm_loadu_ps(acc + i * 4 + 8);
+		__m128 a = _mm_loadu_ps(acc + i * 4 + 12);
+		_MM_TRANSPOSE4_PS(r, g, b, a);
+		__m128 k = straight ? _mm_div_ps(_mm_set1_ps(1.0f), a) : a;
+		__m128i v = pack_rgba(_mm_mul_ps(r, k), _mm_mul_ps(g, k), _mm_mul_ps(b, k), a);
+		if (straight) {
+			// アルファが 0 に丸められる画素は透明の黒にする
+			__m128i a8 = _mm_srli_epi32(v, 24);
+			v = _mm_andnot_si128(_mm_cmpeq_epi32(a8, _mm_setzero_si128()), v);
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), v);
+	}
+	return i;
+}
+
+EUCLASE_TARGET("avx2") inline __m256i pack_rgba(__m256 r, __m256 g, __m256 b, __m256 a)
+{
+	__m256i v = store_channel(_mm256_sqrt_ps(r));
+	v = _mm256_or_si256(v, _mm256_slli_epi32(store_channel(_mm256_sqrt_ps(g)), 8));
+	v = _mm256_or_si256(v, _mm256_slli_epi32(store_channel(_mm256_sqrt_ps(b)), 16));
+	return _mm256_or_si256(v, _mm256_slli_epi32(store_channel(a), 24));
+}
+
+EUCLASE_TARGET("avx2") int store_span_avx2(PixelRGBA *dst, float const *acc, int n, bool straight)
+{
+	// 128bit レーンごとに転置するので、画素の並びは 0 2 4 6 1 3 5 7 になる
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 m0 = _mm256_loadu_ps(acc + i * 4);
+		__m256 m1 = _mm256_loadu_ps(acc + i * 4 + 8);
+		__m256 m2 = _mm256_loadu_ps(acc + i * 4 + 16);
+		__m256 m3 = _mm256_loadu_ps(acc + i * 4 + 24);
+		__m256 t0 = _mm256_unpacklo_ps(m0, m1);
+		__m256 t1 = _mm256_unpackhi_ps(m0, m1);
+		__m256 t2 = _mm256_unpacklo_ps(m2, m3);
+		__m256 t3 = _mm256_unpackhi_ps(m2, m3);
+		__m256 r = _mm256_castpd_ps(_mm256_unpacklo_pd(_mm256_castps_pd(t0), _mm256_castps_pd(t2)));
+		__m256 g = _mm256_castpd_ps(_mm256_unpackhi_pd(_mm256_castps_pd(t0), _mm256_castps_pd(t2)));
+		__m256 b = _mm256_castpd_ps(_mm256_unpacklo_pd(_mm256_castps_pd(t1), _mm256_castps_pd(t3)));
+		__m256 a = _mm256_castpd_ps(_mm256_unpackhi_pd(_mm256_castps_pd(t1), _mm256_castps_pd(t3)));
+		__m256 k = straight ? _mm256_div_ps(_mm256_set1_ps(1.0f), a) : a;
+		__m256i v = pack_rgba(_mm256_mul_ps(r, k), _mm256_mul_ps(g, k), _mm256_mul_ps(b, k), a);
+		if (straight) {
+			__m256i a8 = _mm256_srli_epi32(v, 24);
+			v = _mm256_andnot_si256(_mm256_cmpeq_epi32(a8, _mm256_setzero_si256()), v);
+		}
+		v = _mm256_permutevar8x32_epi32(v, order);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), v);
+	}
+	return i;
+}
+
+#endif
+
+// テーブル版（sqrt を使わない）
+void blend_table(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk, int n)
+{
+	for (int i = 0; i < n; i++) {
+		uint8_t sa = msk ? mask_alpha(src[i].a, msk[i]) : src[i].a;
+		if (sa == 0) continue;
+		PixelRGBA const &d = dst[i];
+		if (d.a == 0 || sa == 255) {
+			dst[i] = PixelRGBA(src[i].r, src[i].g, src[i].b, sa);
+			continue;
+		}
+		float oa = euclase::unorm(sa);
+		float ba = euclase::unorm(d.a);
+		float inv = 1 - oa;
+		float a = oa + ba * inv;
+		float r = (euclase::linear(src[i].r) * oa + euclase::linear(d.r) * ba * inv) / a;
+		float g = (euclase::linear(src[i].g) * oa + euclase::linear(d.g) * ba * inv) / a;
+		float b = (euclase::linear(src[i].b) * oa + euclase::linear(d.b) * ba * inv) / a;
+		uint8_t a8 = a >= 1 ? 255 : (uint8_t)floor(a * 255 + 0.5);
+		dst[i] = PixelRGBA(euclase::gamma8(r), euclase::gamma8(g), euclase::gamma8(b), a8);
+	}
+}
+
+// 固定小数点版
+void blend_fixed(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk, int n)
+{
+	for (int i = 0; i < n; i++) {
+		PixelRGBA color = src[i];
+		if (msk) color.a = mask_alpha(color.a, msk[i]);
+		dst[i] = AlphaBlend::blend_with_gamma_collection_fixed(dst[i], color);
+	}
+}
+
+} // namespace
+
+void AlphaBlend::blend_with_gamma_collection(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk, int n, GammaMethod method)
+{
+	if (method == GammaMethod::Fixed) {
+		blend_fixed(dst, src, msk, n);
+		return;
+	}
+	const euclase::Isa isa = euclase::cpuIsa();
+	if (method == GammaMethod::Auto && isa == euclase::Isa::Generic) method = GammaMethod::Table;
+	if (method == GammaMethod::Table) {
+		blend_table(dst, src, msk, n);
+		return;
+	}
+	int (*span)(PixelRGBA *, PixelRGBA const *, uint8_t const *, int) = blend_span_portable;
+#if defined(EUCLASE_X86)
+	if (isa >= euclase::Isa::AVX512) {
+		span = blend_span_avx512;
+	} else if (isa >= euclase::Isa::AVX2) {
+		span = blend_span_avx2;
+	} else if (isa >= euclase::Isa::SSE2) {
+		span = blend_span_sse2;
+	}
+#endif
+	int i = span(dst, src, msk, n);
+	for (; i < n; i++) {
+		PixelRGBA color = src[i];
+		if (msk) color.a = mask_alpha(color.a, msk[i]);
+		dst[i] = blend_with_gamma_collection(dst[i], color);
+	}
+}
+
+void AlphaBlend::blend_color_with_gamma_collection(PixelRGBA *dst, PixelRGBA const &color, uint8_t const *alpha, int n, GammaMethod method)
+{
+	PixelRGBA tmp[64];
+	for (int i = 0; i < n; i += 64) {
+		int k = std::min(n - i, 64);
+		for (int j = 0; j < k; j++) {
+			tmp[j] = color;
+			if (alpha) tmp[j].a = alpha[i + j];
+		}
+		blend_with_gamma_collection(dst + i, tmp, nullptr, k, method);
+	}
+}
+
+char const *AlphaBlend::span_kernel_name()
+{
+	switch (euclase::cpuIsa()) {
+#if defined(EUCLASE_X86)
+	case euclase::Isa::AVX512:
+		return "AVX-512";
+	case euclase::Isa::AVX2:
+		return "AVX2";
+	case euclase::Isa::SSE2:
+		return "SSE2";
+#endif
+	default:
+		return "portable";
+	}
+}
+
+void AlphaBlend::accumulate_premultiplied(float *acc, PixelRGBA const *src, int opacity, int n)
+{
+	const float k = opacity / 255.0f;
+	for (int i = 0; i < n; i++) {
+		if (src[i].a == 0) continue;
+		const float sa = euclase::unorm(src[i].a) * k;
+		const float t = 1 - sa;
+		float *p = acc + i * 4;
+		p[0] = p[0] * t + euclase::linear(src[i].r) * sa;
+		p[1] = p[1] * t + euclase::linear(src[i].g) * sa;
+		p[2] = p[2] * t + euclase::linear(src[i].b) * sa;
+		p[3] = p[3] * t + sa;
+	}
+}
+
+void AlphaBlend::accumulate_premultiplied(float *acc, PixelRGBA const &color, int opacity, int n)
+{
+	const float sa = euclase::unorm(color.a) * (opacity / 255.0f);
+	const float t = 1 - sa;
+	const float r = euclase::linear(color.r) * sa;
+	const float g = euclase::linear(color.g) * sa;
+	const float b = euclase::linear(color.b) * sa;
+	for (int i = 0; i < n; i++) {
+		float *p = acc + i * 4;
+		p[0] = p[0] * t + r;
+		p[1] = p[1] * t + g;
+		p[2] = p[2] * t + b;
+		p[3] = p[3] * t + sa;
+	}
+}
+
+// 合成モード
+// 乗算済みアルファで co = cs * (1 - ab) + cb * (1 - as) + as * ab * B(Cb, Cs)（cb = Cb * ab, cs = Cs * as）
+// 最後の項はどのモードも cb, cs のままで書けるので、画素ごとの除算はいらない。
+// モードごとにテンプレートで実体化し、1行の中ではモードで分岐しない
+
+namespace {
+
+using BlendMode = AlphaBlend::BlendMode;
+
+template <typename T> inline T unit();
+template <> inline float unit<float>() { return 1; }
+template <> inline AlphaBlend::fixed_t unit<AlphaBlend::fixed_t>() { return AlphaBlend::fixed_t::value1(); }
+
+// float と fixed_t の両方で使う
+template <BlendMode MODE> struct BlendTerm;
+
+template <> struct BlendTerm<BlendMode::Normal> {
+	template <typename T> static inline T apply(T cb, T ab, T cs, T as)
+	{
+		(void)cb;
+		(void)as;
+		return cs * ab;
+	}
+};
+
+template <> struct BlendTerm<BlendMode::Multiply> {
+	template <typename T> static inline T apply(T cb, T ab, T cs, T as)
+	{
+		(void)ab;
+		(void)as;
+		return cb * cs;
+	}
+};
+
+template <> struct BlendTerm<BlendMode::Screen> {
+	template <typename T> static inline T apply(T cb, T ab, T cs, T as)
+	{
+		return cb * as + cs * ab - cb * cs;
+	}
+};
+
+template <> struct BlendTerm<BlendMode::Overlay> {
+	template <typename T> static inline T apply(T cb, T ab, T cs, T as)
+	{
+		// Cb <= 0.5 なら Multiply(Cs, 2Cb)、そうでなければ Screen(Cs, 2Cb - 1)
+		const T t = cb + cb - ab;
+		return t <= T() ? (cb + cb) * cs : cs * ab + t * as - t * cs;
+	}
+};
+
+template <> struct BlendTerm<BlendMode::Add> {
+	template <typename T> static inline T apply(T cb, T ab, T cs, T as)
+	{
+		return std::min(as * ab, cb * as + cs * ab);
+	}
+};
+
+template <> struct BlendTerm<BlendMode::Subtract> {
+	template <typename T> static inline T apply(T cb, T ab, T cs, T as)
+	{
+		return std::max(T(), cb * as - cs * ab);
+	}
+};
+
+template <> struct BlendTerm<BlendMode::Darken> {
+	template <typename T> static inline T apply(T cb, T ab, T cs, T as)
+	{
+		return std::min(cb * as, cs * ab);
+	}
+};
+
+template <> struct BlendTerm<BlendMode::Lighten> {
+	template <typename T> static inline T apply(T cb, T ab, T cs, T as)
+	{
+		return std::max(cb * as, cs * ab);
+	}
+};
+
+template <> struct BlendTerm<BlendMode::Difference> {
+	template <typename T> static inline T apply(T cb, T ab, T cs, T as)
+	{
+		const T x = cb * as;
+		const T y = cs * ab;
+		return x < y ? y - x : x - y;
+	}
+};
+
+template <BlendMode MODE, typename T> inline T blend_term(T cb, T ab, T cs, T as)
+{
+	if (MODE == BlendMode::Normal) return cs + cb * (unit<T>() - as);
+	return cs * (unit<T>() - ab) + cb * (unit<T>() - as) + BlendTerm<MODE>::apply(cb, ab, cs, as);
+}
+
+// step が 0 なら src[0] を単色として使う
+template <BlendMode MODE> void accumulate_mode(float *acc, PixelRGBA const *src, int step, int opacity, int n)
+{
+	const float k = opacity / 255.0f;
+	for (int i = 0; i < n; i++) {
+		PixelRGBA const &s = src[i * step];
+		if (s.a == 0) continue;
+		const float as = euclase::unorm(s.a) * k;
+		float *p = acc + i * 4;
+		const float ab = p[3];
+		p[0] = blend_term<MODE>(p[0], ab, euclase::linear(s.r) * as, as);
+		p[1] = blend_term<MODE>(p[1], ab, euclase::linear(s.g) * as, as);
+		p[2] = blend_term<MODE>(p[2], ab, euclase::linear(s.b) * as, as);
+		p[3] = as + ab * (1 - as);
+	}
+}
+
+template <BlendMode MODE> void accumulate_mode_fixed(AlphaBlend::fixed_t *acc, PixelRGBA const *src, int step, int opacity, int n)
+{
+	using fixed_t = AlphaBlend::fixed_t;
+	const fixed_t k((uint8_t)std::max(0, std::min(opacity, 255)));
+	for (int i = 0; i < n; i++) {
+		PixelRGBA const &s = src[i * step];
+		if (s.a == 0) continue;
+		const fixed_t as = fixed_t(s.a) * k;
+		fixed_t *p = acc + i * 4;
+		const fixed_t ab = p[3];
+		p[0] = blend_term<MODE>(p[0], ab, fixed_t::degamma(s.r) * as, as);
+		p[1] = blend_term<MODE>(p[1], ab, fixed_t::degamma(s.g) * as, as);
+		p[2] = blend_term<MODE>(p[2], ab, fixed_t::degamma(s.b) * as, as);
+		p[3] = as + ab * (fixed_t::value1() - as);
+	}
+}
+
+// 重みは blend_with_gamma_collection_fixed と同じく 8bit のアルファから整数で求める
+// as * ab * B(Cb, Cs) の B は、アルファを 1 として BlendTerm を呼べば得られる
+template <BlendMode MODE> void blend_mode_span_fixed(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk, int n)
+{
+	using fixed_t = AlphaBlend::fixed_t;
+	const fixed_t one = fixed_t::value1();
+	for (int i = 0; i < n; i++) {
+		const uint32_t sa = msk ? mask_alpha(src[i].a, msk[i]) : src[i].a;
+		if (sa == 0) continue;
+		PixelRGBA const &d = dst[i];
+		const uint32_t ws = sa * (255 - d.a);
+		const uint32_t wb = d.a * (255 - sa);
+		const uint32_t wm = sa * d.a;
+		const uint32_t a = ws + wb + wm; // 255 * 255 * (as + ab * (1 - as))
+		auto mix = [&](uint8_t s, uint8_t b){
+			const fixed_t cs = fixed_t::degamma(s);
+			const fixed_t cb = fixed_t::degamma(b);
+			const uint64_t m = std::max(0, std::min(BlendTerm<MODE>::apply(cb, one, cs, one).raw(), fixed_t::ONE));
+			const uint64_t v = (uint64_t)cs.raw() * ws + (uint64_t)cb.raw() * wb + m * wm;
+			return fixed_t::raw((int32_t)((v + a / 2) / a)).gamma8();
+		};
+		dst[i] = PixelRGBA(mix(src[i].r, d.r), mix(src[i].g, d.g), mix(src[i].b, d.b), (a + 127) / 255);
+	}
+}
+
+template <BlendMode MODE> void blend_mode_span(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk, int n, AlphaBlend::GammaMethod method)
+{
+	if (method == AlphaBlend::GammaMethod::Fixed) {
+		blend_mode_span_fixed<MODE>(dst, src, msk, n);
+		return;
+	}
+	for (int i = 0; i < n; i++) {
+		const uint8_t sa = msk ? mask_alpha(src[i].a, msk[i]) : src[i].a;
+		if (sa == 0) continue;
+		PixelRGBA const &d = dst[i];
+		const float as = euclase::unorm(sa);
+		const float ab = euclase::unorm(d.a);
+		const float a = as + ab * (1 - as);
+		const float r = blend_term<MODE>(euclase::linear(d.r) * ab, ab, euclase::linear(src[i].r) * as, as);
+		const float g = blend_term<MODE>(euclase::linear(d.g) * ab, ab, euclase::linear(src[i].g) * as, as);
+		const float b = blend_term<MODE>(euclase::linear(d.b) * ab, ab, euclase::linear(src[i].b) * as, as);
+		const float inv = 1 / a;
+		const uint8_t a8 = a >= 1 ? 255 : (uint8_t)floor(a * 255 + 0.5);
+		dst[i] = PixelRGBA(euclase::gamma8(r * inv), euclase::gamma8(g * inv), euclase::gamma8(b * inv), a8);
+	}
+}
+
+using AccumulateFunc = void (*)(float *acc, PixelRGBA const *src, int step, int opacity, int n);
+
+AccumulateFunc accumulate_func(BlendMode mode)
+{
+	switch (mode) {
+	case BlendMode::Multiply: return accumulate_mode<BlendMode::Multiply>;
+	case BlendMode::Screen: return accumulate_mode<BlendMode::Screen>;
+	case BlendMode::Overlay: return accumulate_mode<BlendMode::Overlay>;
+	case BlendMode::Add: return accumulate_mode<BlendMode::Add>;
+	case BlendMode::Subtract: return accumulate_mode<BlendMode::Subtract>;
+	case BlendMode::Darken: return accumulate_mode<BlendMode::Darken>;
+	case BlendMode::Lighten: return accumulate_mode<BlendMode::Lighten>;
+	case BlendMode::Difference: return accumulate_mode<BlendMode::Difference>;
+	default: return nullptr;
+	}
+}
+
+using AccumulateFixedFunc = void (*)(AlphaBlend::fixed_t *acc, PixelRGBA const *src, int step, int opacity, int n);
+
+AccumulateFixedFunc accumulate_fixed_func(BlendMode mode)
+{
+	switch (mode) {
+	case BlendMode::Multiply: return accumulate_mode_fixed<BlendMode::Multiply>;
+	case BlendMode::Screen: return accumulate_mode_fixed<BlendMode::Screen>;
+	case BlendMode::Overlay: return accumulate_mode_fixed<BlendMode::Overlay>;
+	case BlendMode::Add: return accumulate_mode_fixed<BlendMode::Add>;
+	case BlendMode::Subtract: return accumulate_mode_fixed<BlendMode::Subtract>;
+	case BlendMode::Darken: return accumulate_mode_fixed<BlendMode::Darken>;
+	case BlendMode::Lighten: return accumulate_mode_fixed<BlendMode::Lighten>;
+	case BlendMode::Difference: return accumulate_mode_fixed<BlendMode::Difference>;
+	default: return accumulate_mode_fixed<BlendMode::Normal>;
+	}
+}
+
+} // namespace
+
+char const *AlphaBlend::blend_mode_name(BlendMode mode)
+{
+	switch (mode) {
+	case BlendMode::Normal: return "Normal";
+	case BlendMode::Multiply: return "Multiply";
+	case BlendMode::Screen: return "Screen";
+	case BlendMode::Overlay: return "Overlay";
+	case BlendMode::Add: return "Add";
+	case BlendMode::Subtract: return "Subtract";
+	case BlendMode::Darken: return "Darken";
+	case BlendMode::Lighten: return "Lighten";
+	case BlendMode::Difference: return "Difference";
+	}
+	return "";
+}
+
+AlphaBlend::SpanBlendFunc AlphaBlend::span_blend_func(BlendMode mode)
+{
+	switch (mode) {
+	case BlendMode::Multiply: return blend_mode_span<BlendMode::Multiply>;
+	case BlendMode::Screen: return blend_mode_span<BlendMode::Screen>;
+	case BlendMode::Overlay: return blend_mode_span<BlendMode::Overlay>;
+	case BlendMode::Add: return blend_mode_span<BlendMode::Add>;
+	case BlendMode::Subtract: return blend_mode_span<BlendMode::Subtract>;
+	case BlendMode::Darken: return blend_mode_span<BlendMode::Darken>;
+	case BlendMode::Lighten: return blend_mode_span<BlendMode::Lighten>;
+	case BlendMode::Difference: return blend_mode_span<BlendMode::Difference>;
+	default: return static_cast<SpanBlendFunc>(&AlphaBlend::blend_with_gamma_collection);
+	}
+}
+
+void AlphaBlend::accumulate_premultiplied(float *acc, PixelRGBA const *src, int opacity, int n, BlendMode mode)
+{
+	if (AccumulateFunc func = accumulate_func(mode)) {
+		func(acc, src, 1, opacity, n);
+	} else {
+		accumulate_premultiplied(acc, src, opacity, n);
+	}
+}
+
+void AlphaBlend::accumulate_premultiplied(float *acc, PixelRGBA const &color, int opacity, int n, BlendMode mode)
+{
+	if (AccumulateFunc func = accumulate_func(mode)) {
+		func(acc, &color, 0, opacity, n);
+	} else {
+		accumulate_premultiplied(acc, color, opacity, n);
+	}
+}
+
+static inline uint8_t unorm8(float v)
+{
+	if (v <= 0) return 0;
+	if (v >= 1) return 255;
+	return (uint8_t)floor(v * 255 + 0.5);
+}
+
+// SIMD 版が処理した画素数を返す
+static int store_span(PixelRGBA *dst, float const *acc, int n, bool straight)
+{
+#if defined(EUCLASE_X86)
+	const euclase::Isa isa = euclase::cpuIsa();
+	if (isa >= euclase::Isa::AVX2) return store_span_avx2(dst, acc, n, straight);
+	if (isa >= euclase::Isa::SSE2) return store_span_sse2(dst, acc, n, straight);
+#else
+	(void)dst;
+	(void)acc;
+	(void)n;
+	(void)straight;
+#endif
+	return 0;
+}
+
+void AlphaBlend::store_premultiplied(PixelRGBA *dst, float const *acc, int n)
+{
+	// 表示用の乗算済み値は sqrt(P / A) * A = sqrt(P * A)
+	for (int i = store_span(dst, acc, n, false); i < n; i++) {
+		float const *p = acc + i * 4;
+		const float a = p[3];
+		dst[i] = PixelRGBA(euclase::gamma8(p[0] * a), euclase::gamma8(p[1] * a), euclase::gamma8(p[2] * a), unorm8(a));
+	}
+}
+
+void AlphaBlend::store_straight(PixelRGBA *dst, float const *acc, int n)
+{
+	for (int i = store_span(dst, acc, n, true); i < n; i++) {
+		float const *p = acc + i * 4;
+		const uint8_t a = unorm8(p[3]);
+		if (a == 0) {
+			dst[i] = PixelRGBA(0, 0, 0, 0);
+			continue;
+		}
+		const float inv = 1 / p[3];
+		dst[i] = PixelRGBA(euclase::gamma8(p[0] * inv), euclase::gamma8(p[1] * inv), euclase::gamma8(p[2] * inv), a);
+	}
+}
+
+void AlphaBlend::accumulate_premultiplied(fixed_t *acc, PixelRGBA const *src, int opacity, int n, BlendMode mode)
+{
+	accumulate_fixed_func(mode)(acc, src, 1, opacity, n);
+}
+
+void AlphaBlend::accumulate_premultiplied(fixed_t *acc, PixelRGBA const &color, int opacity, int n, BlendMode mode)
+{
+	accumulate_fixed_func(mode)(acc, &color, 0, opacity, n);
+}
+
+void AlphaBlend::store_premultiplied(PixelRGBA *dst, fixed_t const *acc, int n)
+{
+	for (int i = 0; i < n; i++) {
+		fixed_t const *p = acc + i * 4;
+		const fixed_t a = p[3];
+		dst[i] = PixelRGBA((p[0] * a).gamma8(), (p[1] * a).gamma8(), (p[2] * a).gamma8(), (uint8_t)a);
+	}
+}
+
+void AlphaBlend::store_straight(PixelRGBA *dst, fixed_t const *acc, int n)
+{
+	for (int i = 0; i < n; i++) {
+		fixed_t const *p = acc + i * 4;
+		const uint8_t a = (uint8_t)p[3];
+		if (a == 0) {
+			dst[i] = PixelRGBA(0, 0, 0, 0);
+			continue;
+		}
+		dst[i] = PixelRGBA((p[0] / p[3]).gamma8(), (p[1] / p[3]).gamma8(), (p[2] / p[3]).gamma8(), a);
+	}
+}
 
-const int16_t *AlphaBlend::fixed_t::lut_mul()
+void AlphaBlend::premultiply(PixelRGBA *p, int n)
 {
-	if (lut_mul_[0]) {
-		for (int i = 0; i < 65536; i++) {
+	for (int i = 0; i < n; i++) {
+		const int a = p[i].a;
+		if (a == 255) continue;
+		p[i].r = div255(p[i].r * a);
+		p[i].g = div255(p[i].g * a);
+		p[i].b = div255(p[i].b * a);
+	}
+}
 
+void AlphaBlend::unpremultiply(PixelRGBA *p, int n)
+{
+	for (int i = 0; i < n; i++) {
+		const int a = p[i].a;
+		if (a == 255) continue;
+		if (a == 0) {
+			p[i] = PixelRGBA(0, 0, 0, 0);
+			continue;
 		}
+		p[i].r = std::min(255, (p[i].r * 255 + a / 2) / a);
+		p[i].g = std::min(255, (p[i].g * 255 + a / 2) / a);
+		p[i].b = std::min(255, (p[i].b * 255 + a / 2) / a);
 	}
-	return lut_mul_;
 }
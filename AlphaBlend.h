@@ -37,57 +37,95 @@ public:
 		return FPixelRGBA(degamma(pix.r), degamma(pix.g), degamma(pix.b), pix.a);
 	}
 
+	// 固定小数点数（8.24、1.0 == 1 << 24）
+	// 整数の加減乗除だけなので、コンパイラや SIMD の幅によらず結果が同じになる。
+	// 格納は 32bit、積と商の途中だけ 64bit。リニア値は 8bit の 1 (約 1.5e-5) でも 258 になる
 	class fixed_t {
+	public:
+		static const int BITS = 24;
+		static const int32_t ONE = 1 << BITS;
 	private:
-		int16_t value;
-		static int16_t lut_mul_[65536];
-		static const int16_t *lut_mul();
+		static const int GAMMA_SHIFT = 11; // gamma_lut_ の間隔
+		int32_t value = 0;
+		static uint32_t degamma_lut_[256];
+		static uint32_t threshold_[257]; // gamma8() が k 以上を返す最小の値
+		static uint8_t gamma_lut_[(ONE >> GAMMA_SHIFT) + 1];
+		struct Tables;
+		static Tables tables_;
 	public:
-		explicit fixed_t(int16_t v = 0)
-			: value(v)
+		fixed_t() = default;
+		explicit fixed_t(uint8_t v)
+			: value((int32_t)(((int64_t)v * ONE + 127) / 255))
+		{
+		}
+		explicit fixed_t(float v)
+			: value((int32_t)floor((double)v * ONE + 0.5))
 		{
 		}
-		explicit fixed_t(uint8_t v = 0)
-			: value(v * 4096 / 255)
+		static fixed_t raw(int32_t v)
 		{
+			fixed_t t;
+			t.value = v;
+			return t;
 		}
-		explicit fixed_t(float v = 0)
-			: value((int16_t)floor(v * 4096 + 0.5))
+		int32_t raw() const
 		{
+			return value;
 		}
 		fixed_t operator + (fixed_t r) const
 		{
-			return fixed_t((int16_t)(value + r.value));
+			return raw(value + r.value);
 		}
 		fixed_t operator - (fixed_t r) const
 		{
-			return fixed_t((int16_t)(value - r.value));
+			return raw(value - r.value);
 		}
 		fixed_t operator * (fixed_t r) const
 		{
-			return fixed_t((int16_t)(((int32_t)value * r.value) >> 12));
+			return raw((int32_t)(((int64_t)value * r.value + ONE / 2) >> BITS));
 		}
 		fixed_t operator / (fixed_t r) const
 		{
-			return fixed_t((int16_t)((((int32_t)value << 12) + value) / r.value));
+			return raw((int32_t)((((int64_t)value << BITS) + r.value / 2) / r.value));
+		}
+		bool operator < (fixed_t r) const
+		{
+			return value < r.value;
+		}
+		bool operator <= (fixed_t r) const
+		{
+			return value <= r.value;
 		}
 		explicit operator uint8_t () const
 		{
-			if (value < 0) return 0;
-			if (value > 0x0fff) return 255;
-			return value >> 4;
+			if (value <= 0) return 0;
+			if (value >= ONE) return 255;
+			return (uint8_t)(((int64_t)value * 255 + ONE / 2) >> BITS);
 		}
 		explicit operator float () const
 		{
-			return float(value / 4096.0);
+			return float(double(value) / ONE);
 		}
 		static fixed_t value0()
 		{
-			return fixed_t((int16_t)0);
+			return raw(0);
 		}
 		static fixed_t value1()
 		{
-			return fixed_t((int16_t)4096);
+			return raw(ONE);
+		}
+		// 8bit <-> リニア。どちらも整数だけで作ったテーブルを引く
+		static fixed_t degamma(uint8_t v)
+		{
+			return raw(degamma_lut_[v]);
+		}
+		uint8_t gamma8() const
+		{
+			if (value <= 0) return 0;
+			if (value >= ONE) return 255;
+			int k = gamma_lut_[value >> GAMMA_SHIFT];
+			while (k < 255 && (uint32_t)value >= threshold_[k + 1]) k++;
+			return k;
 		}
 	};
 
@@ -148,6 +186,81 @@ public:
 	{
 		return (PixelRGBA)gamma(blend(degamma(FPixelRGBA(base)), degamma(FPixelRGBA(over))));
 	}
+
+	// blend_with_gamma_collection の固定小数点版
+	// 重みは 8bit のアルファから整数で正確に求め（合計 a <= 255 * 255）、丸めは1チャンネル1回だけ
+	static inline PixelRGBA blend_with_gamma_collection_fixed(PixelRGBA const &base, PixelRGBA const &over)
+	{
+		if (over.a == 0) return base;
+		if (base.a == 0 || over.a == 255) return over;
+		const uint32_t wo = over.a * 255;
+		const uint32_t wb = base.a * (255 - over.a);
+		const uint32_t a = wo + wb;
+		auto mix = [&](uint8_t o, uint8_t b){
+			const uint64_t v = (uint64_t)fixed_t::degamma(o).raw() * wo + (uint64_t)fixed_t::degamma(b).raw() * wb;
+			return fixed_t::raw((int32_t)((v + a / 2) / a)).gamma8();
+		};
+		return PixelRGBA(mix(over.r, base.r), mix(over.g, base.g), mix(over.b, base.b), (a + 127) / 255);
+	}
+
+	// 8bit <-> リニアの変換方法
+	enum class GammaMethod {
+		Auto,    // SIMD 版があれば Compute、なければ Table
+		Compute, // 乗算と sqrt（SIMD）
+		Table,   // 変換テーブル（Auto から、SIMD 版が無いときに使う）
+		Fixed,   // 固定小数点（fixed_t）。整数演算だけなので、どの環境でも結果が同じ
+	};
+
+	// 1行分をまとめて合成する
+	// dst[i] = blend_with_gamma_collection(dst[i], src[i])
+	// msk が null でなければ src のアルファに msk[i] / 255 を掛けてから合成する（整数、切り捨て）
+	// AVX2 / SSE2 / ポータブル版はスカラー版と同じ順序で演算するので結果は一致する。
+	// 許容誤差は各チャンネル ±1（コンパイラが演算順序を変えた場合の丸めの差）
+	// GammaMethod::Table の結果もスカラー版と一致する
+	static void blend_with_gamma_collection(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk, int n, GammaMethod method = GammaMethod::Auto);
+
+	// 単色を合成する。alpha が null なら color.a をそのまま使う
+	static void blend_color_with_gamma_collection(PixelRGBA *dst, PixelRGBA const &color, uint8_t const *alpha, int n, GammaMethod method = GammaMethod::Auto);
+
+	static char const *span_kernel_name();
+
+	// 合成モード。リニア空間で W3C Compositing の分離可能な合成モードの式を使う
+	enum class BlendMode {
+		Normal,
+		Multiply,
+		Screen,
+		Overlay,
+		Add,
+		Subtract,
+		Darken,
+		Lighten,
+		Difference,
+	};
+	static char const *blend_mode_name(BlendMode mode);
+
+	// 1行分の合成関数。モードごとにテンプレートで実体化したものを返す（Normal は blend_with_gamma_collection）
+	// Normal 以外は変換テーブルを使う（method が Fixed のときは固定小数点）
+	using SpanBlendFunc = void (*)(PixelRGBA *dst, PixelRGBA const *src, uint8_t const *msk, int n, GammaMethod method);
+	static SpanBlendFunc span_blend_func(BlendMode mode);
+
+	// 合成用バッファ（リニア空間・乗算済みアルファの float RGBA）
+	// 重ねるのは乗算と加算だけで、除算は 8bit に戻すときに1画素1回（store_straight）だけ
+	static void accumulate_premultiplied(float *acc, PixelRGBA const *src, int opacity, int n);
+	static void accumulate_premultiplied(float *acc, PixelRGBA const &color, int opacity, int n);
+	static void accumulate_premultiplied(float *acc, PixelRGBA const *src, int opacity, int n, BlendMode mode);
+	static void accumulate_premultiplied(float *acc, PixelRGBA const &color, int opacity, int n, BlendMode mode);
+	static void store_premultiplied(PixelRGBA *dst, float const *acc, int n); // Format_RGBA8888_Premultiplied
+	static void store_straight(PixelRGBA *dst, float const *acc, int n); // Format_RGBA8888
+
+	// 合成用バッファの固定小数点版
+	static void accumulate_premultiplied(fixed_t *acc, PixelRGBA const *src, int opacity, int n, BlendMode mode = BlendMode::Normal);
+	static void accumulate_premultiplied(fixed_t *acc, PixelRGBA const &color, int opacity, int n, BlendMode mode = BlendMode::Normal);
+	static void store_premultiplied(PixelRGBA *dst, fixed_t const *acc, int n);
+	static void store_straight(PixelRGBA *dst, fixed_t const *acc, int n);
+
+	// 8bit の Format_RGBA8888 <-> Format_RGBA8888_Premultiplied
+	static void premultiply(PixelRGBA *p, int n);
+	static void unpremultiply(PixelRGBA *p, int n);
 };
 
 #endif // ALPHABLEND_H
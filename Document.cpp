@@ -3,18 +3,316 @@
 #include <QDebug>
 #include <QElapsedTimer>
 #include <QPainter>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+#include <algorithm>
+#include <atomic>
 #include <functional>
+#include <list>
+
+const size_t MAX_UNDO_STEPS = 100;
+const size_t MAX_COMPOSITE_TILES = 4096; // 64x64 RGBA で 64MB
+const int MAX_MIP_LEVEL = 8;
+const size_t MAX_MIP_TILES = 8192; // 一様でないタイルの数。64x64 RGBA で 128MB
+const size_t MAX_MASK_TILES = 256; // 選択範囲のマスクのキャッシュ。64x64 Grayscale8 で 1MB
+
+// 1つの操作で変更される前のレイヤーの状態
+struct Document::LayerJournal {
+	Layer *layer = nullptr;
+	std::shared_ptr<Layer> keep; // 削除されたレイヤーも履歴が参照している間は残す（選択範囲は所有しない）
+	QPoint offset;
+	bool replaced = false; // true: レイヤー全体を snapshot に保持
+	Layer snapshot;
+	std::unordered_map<uint64_t, PanelPtr> tiles; // 変更前のタイル（存在しなかったときは null）
+
+	void record(uint64_t key, PanelPtr const *panel)
+	{
+		if (replaced) return;
+		if (tiles.find(key) != tiles.end()) return;
+		tiles[key] = panel ? *panel : PanelPtr();
+	}
+
+	bool isEmpty() const
+	{
+		return !replaced && tiles.empty() && offset == layer->offset();
+	}
+
+	// 記録した状態に戻し、戻す前の状態を逆方向用に保持する
+	void swap()
+	{
+		QPoint o = layer->offset();
+		if (replaced) {
+			Layer current = *layer;
+			current.journal_ = nullptr;
+			*layer = snapshot;
+			layer->journal_ = nullptr;
+			layer->markAll();
+			snapshot = current;
+		} else {
+			for (auto &pair : tiles) {
+				QPoint pos = Layer::tilePos(pair.first);
+				PanelPtr *p = layer->findPanel(pos.x(), pos.y());
+				PanelPtr current = p ? *p : PanelPtr();
+				layer->setPanel(pos, pair.second);
+				pair.second = current;
+			}
+		}
+		layer->setOffset(offset);
+		offset = o;
+	}
+};
+
+struct Document::UndoStep {
+	QSize size;
+	std::list<LayerJournal> layers;
+	bool restacked = false; // レイヤーの追加・削除・並べ替えがあった
+	std::vector<std::shared_ptr<Layer>> stack; // 変更前のレイヤーの並び。削除したレイヤーもここで持つ
+	int current_layer = 0;
+};
+
+// 描画スレッドが sync の外で読むための、レイヤーの一部の写し。
+// 元のタイルの参照を持ち続けるので、書き込み側は writablePanel でタイルを複製してから書く
+struct Document::LayerSnapshot {
+	Layer layer;
+	std::vector<PanelPtr> sources;
+};
+
+// 縮小画像の1タイル。全画素が同じ色のときは image を持たない
+struct MipTile {
+	QImage image;
+	uint8_t color[4] = {}; // RGBA8888
+};
+
+// 合成用バッファ（float か AlphaBlend::fixed_t）を8bit に書き出す
+template <typename T> static void storeAccumulated(euclase::PixelRGBA *dst, T const *acc, int n, bool premultiplied)
+{
+	if (premultiplied) {
+		AlphaBlend::store_premultiplied(dst, acc, n);
+	} else {
+		AlphaBlend::store_straight(dst, acc, n);
+	}
+}
+
+// 縮小画像を重ねるときの1レイヤー分
+struct MipLayerTile {
+	MipTile tile;
+	int opacity;
+	Document::BlendMode mode;
+};
+
+// リニア空間・乗算済みアルファで重ね、タイル内の範囲 q を image の pos へ直接書き出す
+template <typename T> static void compositeMipTiles(std::vector<MipLayerTile> const &tiles, std::vector<T> *acc, QRect const &q, bool premultiplied, QImage *image, QPoint const &pos)
+{
+	std::fill(acc->begin(), acc->end(), T());
+	for (MipLayerTile const &tile : tiles) {
+		MipTile const &t = tile.tile;
+		if (t.image.isNull()) {
+			euclase::PixelRGBA color(t.color[0], t.color[1], t.color[2], t.color[3]);
+			if (color.a == 0) continue;
+			AlphaBlend::accumulate_premultiplied(acc->data(), color, tile.opacity, 64 * 64, tile.mode);
+		} else {
+			for (int i = 0; i < 64; i++) {
+				euclase::PixelRGBA const *src = reinterpret_cast<euclase::PixelRGBA const *>(t.image.constScanLine(i));
+				AlphaBlend::accumulate_premultiplied(&(*acc)[i * 64 * 4], src, tile.opacity, 64, tile.mode);
+			}
+		}
+	}
+	for (int i = 0; i < q.height(); i++) {
+		T const *src = &(*acc)[((q.y() + i) * 64 + q.x()) * 4];
+		euclase::PixelRGBA *dst = reinterpret_cast<euclase::PixelRGBA *>(image->scanLine(pos.y() + i)) + pos.x();
+		storeAccumulated(dst, src, q.width(), premultiplied);
+	}
+}
+
+// 1レイヤーの縮小画像のピラミッド。レベル n はドキュメント座標の 1/2^n で、64x64 のタイルに分ける
+// メンバーは mutex（Private::mip_mutex）をロックして使う。足りないタイルはロックせずに作り、できてから登録する
+struct Document::MipPyramid {
+	Layer const *layer = nullptr;
+	QMutex *mutex = nullptr;
+	bool retired = false; // レイヤーが破棄される。layer に触れてはいけない
+	uint64_t version = 0; // 反映済みのレイヤーの変更
+	std::unordered_map<uint64_t, MipTile> levels[MAX_MIP_LEVEL + 1]; // [0] は使わない
+	size_t image_tiles = 0;
+
+	void erase(int level, uint64_t key)
+	{
+		auto it = levels[level].find(key);
+		if (it == levels[level].end()) return;
+		if (!it->second.image.isNull()) image_tiles--;
+		levels[level].erase(it);
+	}
+
+	void dropLevel(int level)
+	{
+		for (auto const &pair : levels[level]) {
+			if (!pair.second.image.isNull()) image_tiles--;
+		}
+		levels[level].clear();
+	}
+
+	// レイヤーの変更を反映する
+	void sync()
+	{
+		const uint64_t v = Layer::currentVersion();
+		if (v == version) return;
+		std::vector<uint64_t> keys;
+		if (!layer->changedTiles(version, &keys)) {
+			for (int level = 1; level <= MAX_MIP_LEVEL; level++) {
+				dropLevel(level);
+			}
+		}
+		for (uint64_t key : keys) {
+			const QRect r(Layer::tilePos(key) + layer->offset(), QSize(64, 64));
+			for (int level = 1; level <= MAX_MIP_LEVEL; level++) {
+				for (int y = (r.top() >> level) & ~63; y <= (r.bottom() >> level); y += 64) {
+					for (int x = (r.left() >> level) & ~63; x <= (r.right() >> level); x += 64) {
+						erase(level, Layer::tileKey(x, y));
+					}
+				}
+			}
+		}
+		version = v;
+	}
+
+	// 128x128 を平均して 64x64 にする。アルファで重み付けする
+	static MipTile reduce(QImage const &src)
+	{
+		MipTile t;
+		t.image = TileAllocator::newTileImage(64, 64, QImage::Format_RGBA8888);
+		for (int y = 0; y < 64; y++) {
+			euclase::PixelRGBA const *s0 = reinterpret_cast<euclase::PixelRGBA const *>(src.constScanLine(y * 2));
+			euclase::PixelRGBA const *s1 = reinterpret_cast<euclase::PixelRGBA const *>(src.constScanLine(y * 2 + 1));
+			euclase::PixelRGBA *d = reinterpret_cast<euclase::PixelRGBA *>(t.image.scanLine(y));
+			for (int x = 0; x < 64; x++) {
+				euclase::PixelRGBA const *p[4] = { &s0[x * 2], &s0[x * 2 + 1], &s1[x * 2], &s1[x * 2 + 1] };
+				int a = 0, r = 0, g = 0, b = 0;
+				for (euclase::PixelRGBA const *q : p) {
+					a += q->a;
+					r += q->r * q->a;
+					g += q->g * q->a;
+					b += q->b * q->a;
+				}
+				if (a == 0) {
+					d[x] = euclase::PixelRGBA();
+				} else {
+					d[x] = euclase::PixelRGBA((r + a / 2) / a, (g + a / 2) / a, (b + a / 2) / a, (a + 2) / 4);
+				}
+			}
+		}
+		uint32_t const *p = reinterpret_cast<uint32_t const *>(t.image.constBits());
+		uint32_t v = p[0];
+		bool transparent = (v & 0xff000000) == 0;
+		for (int i = 1; i < 64 * 64; i++) {
+			if (transparent ? (p[i] & 0xff000000) != 0 : p[i] != v) return t;
+		}
+		if (transparent) v = 0;
+		memcpy(t.color, &v, 4);
+		t.image = QImage();
+		return t;
+	}
+
+	MipTile build(int level, int x, int y, QMutex *sync)
+	{
+		Image panel;
+		panel.setOffset(x * 2, y * 2);
+		if (level == 1) {
+			// レイヤーが破棄されないよう mutex をロックしている間にスナップショットを取る
+			LayerSnapshot snapshot;
+			{
+				QMutexLocker lock(mutex);
+				if (retired) return MipTile();
+				if (sync) sync->lock();
+				takeSnapshot(*layer, QRect(panel.offset(), QSize(128, 128)), &snapshot);
+				if (sync) sync->unlock();
+			}
+			if (snapshot.layer.panels_.empty()) return MipTile();
+			panel.image_ = QImage(128, 128, QImage::Format_RGBA8888);
+			panel.image_.fill(Qt::transparent);
+			renderToEachPanels_(&panel, QPoint(), snapshot.layer, nullptr, QColor(), 255, nullptr);
+		} else {
+			const MipTile children[4] = {
+				tile(level - 1, x * 2, y * 2, sync),
+				tile(level - 1, x * 2 + 64, y * 2, sync),
+				tile(level - 1, x * 2, y * 2 + 64, sync),
+				tile(level - 1, x * 2 + 64, y * 2 + 64, sync),
+			};
+			MipTile const *c[4] = { &children[0], &children[1], &children[2], &children[3] };
+			bool uniform = true;
+			for (MipTile const *t : c) {
+				if (!t->image.isNull() || memcmp(t->color, c[0]->color, 4) != 0) {
+					uniform = false;
+				}
+			}
+			if (uniform) return *c[0];
+			panel.image_ = QImage(128, 128, QImage::Format_RGBA8888);
+			for (int i = 0; i < 4; i++) {
+				const int ox = (i & 1) * 64;
+				const int oy = (i >> 1) * 64;
+				for (int j = 0; j < 64; j++) {
+					euclase::PixelRGBA *d = reinterpret_cast<euclase::PixelRGBA *>(panel.image_.scanLine(oy + j)) + ox;
+					if (c[i]->image.isNull()) {
+						euclase::PixelRGBA color(c[i]->color[0], c[i]->color[1], c[i]->color[2], c[i]->color[3]);
+						std::fill(d, d + 64, color);
+					} else {
+						memcpy(d, c[i]->image.constScanLine(j), 64 * 4);
+					}
+				}
+			}
+		}
+		return reduce(panel.image_);
+	}
+
+	// mutex をロックせずに呼ぶ。作っている間にレイヤーが変更されたら、作ったタイルは登録せずに返すだけにする
+	MipTile tile(int level, int x, int y, QMutex *sync)
+	{
+		const uint64_t key = Layer::tileKey(x, y);
+		uint64_t v;
+		{
+			QMutexLocker lock(mutex);
+			auto it = levels[level].find(key);
+			if (it != levels[level].end()) return it->second;
+			v = version;
+		}
+		MipTile t = build(level, x, y, sync);
+		QMutexLocker lock(mutex);
+		if (retired || version != v) return t;
+		auto r = levels[level].emplace(key, t);
+		if (r.second && !t.image.isNull()) image_tiles++;
+		return r.first->second; // ほかのスレッドが先に登録していればそちらを使う
+	}
+};
 
 struct Document::Private {
 	QSize size;
-	Document::Layer current_layer;
+	std::vector<std::shared_ptr<Document::Layer>> layers; // 下から順に合成する。アンドゥ履歴も参照を持つ
+	int current_layer = 0;
 	Document::Layer filtering_layer;
 	Document::Layer selection_layer;
+
+	uint64_t layers_version = 0; // レイヤーの構成や属性が変更されたバージョン
+
+	// 全レイヤーを合成したタイルのキャッシュ
+	QMutex composite_mutex;
+	std::unordered_map<uint64_t, QImage> composite;
+	uint64_t composite_version = 0; // キャッシュに反映済みの変更
+	uint64_t composite_generation = 0;
+	bool fixed_point = false; // 合成を固定小数点で行う。composite_mutex をロックして使う
+
+	// レイヤーごとの縮小画像。mip_mutex をロックして使う（sync より先にロックする）
+	QMutex mip_mutex;
+	std::unordered_map<Layer const *, std::shared_ptr<MipPyramid>> mips; // 作成中のスレッドも参照を持つ
+
+	int undo_depth = 0;
+	std::unique_ptr<UndoStep> recording;
+	std::vector<std::unique_ptr<UndoStep>> undo_stack;
+	std::vector<std::unique_ptr<UndoStep>> redo_stack;
 };
 
 Document::Document()
 	: m(new Private)
 {
+	m->layers.emplace_back(new Layer);
 }
 
 Document::~Document()
@@ -44,7 +342,7 @@ void Document::setSize(const QSize &s)
 
 Document::Layer *Document::current_layer()
 {
-	return &m->current_layer;
+	return m->layers[m->current_layer].get();
 }
 
 Document::Layer *Document::selection_layer()
@@ -54,7 +352,7 @@ Document::Layer *Document::selection_layer()
 
 Document::Layer *Document::current_layer() const
 {
-	return &m->current_layer;
+	return m->layers[m->current_layer].get();
 }
 
 Document::Layer *Document::selection_layer() const
@@ -62,8 +360,575 @@ Document::Layer *Document::selection_layer() const
 	return &m->selection_layer;
 }
 
-void Document::renderToSinglePanel(Image *target_panel, QPoint const &target_offset, Image const *input_panel, QPoint const &input_offset, Layer const *mask_layer, RenderOption const &opt, QColor const &brush_color, int opacity, bool *abort)
+int Document::layerCount() const
+{
+	return (int)m->layers.size();
+}
+
+Document::Layer *Document::layer(int index) const
+{
+	if (index < 0 || index >= layerCount()) return nullptr;
+	return m->layers[index].get();
+}
+
+int Document::currentLayerIndex() const
+{
+	return m->current_layer;
+}
+
+void Document::setCurrentLayerIndex(int index)
+{
+	if (index < 0 || index >= layerCount()) return;
+	m->current_layer = index;
+}
+
+// レイヤーの並びを変える前に呼ぶ。記録中のアンドゥに変更前の並びを残す
+void Document::recordLayerStack()
+{
+	UndoStep *step = m->recording.get();
+	if (!step || step->restacked) return;
+	step->restacked = true;
+	step->stack = m->layers;
+	step->current_layer = m->current_layer;
+}
+
+Document::Layer *Document::insertLayer(int index, QMutex *sync)
+{
+	index = std::max(0, std::min(index, layerCount()));
+	beginUndoStep();
+	recordLayerStack();
+	std::shared_ptr<Layer> layer = std::make_shared<Layer>();
+	layer->tile_mode_ = true;
+	if (sync) sync->lock();
+	m->layers.insert(m->layers.begin() + index, layer);
+	m->current_layer = index;
+	if (sync) sync->unlock();
+	endUndoStep(sync);
+	return layer.get(); // 空のレイヤーなので合成結果は変わらない
+}
+
+void Document::removeLayer(int index, QMutex *sync)
+{
+	if (index < 0 || index >= layerCount()) return;
+	if (layerCount() < 2) return;
+	beginUndoStep();
+	recordLayerStack();
+	if (sync) sync->lock();
+	std::shared_ptr<Layer> layer = m->layers[index];
+	m->layers.erase(m->layers.begin() + index);
+	if (m->current_layer >= index && m->current_layer > 0) {
+		m->current_layer--;
+	}
+	m->layers_version = Layer::newVersion();
+	if (sync) sync->unlock();
+	retireLayer(layer.get());
+	endUndoStep(sync);
+}
+
+// 並びから外したレイヤーの縮小画像を捨てる。作成中の描画スレッドには retired で知らせる
+// レイヤー自体はアンドゥ履歴が参照を持つ間は残る
+void Document::retireLayer(Layer const *layer)
+{
+	QMutexLocker lock(&m->mip_mutex);
+	auto it = m->mips.find(layer);
+	if (it == m->mips.end()) return;
+	it->second->retired = true;
+	m->mips.erase(it);
+}
+
+// sync をロックして呼ぶ。r はドキュメント座標
+void Document::takeSnapshot(Layer const &src, QRect const &r, LayerSnapshot *out)
+{
+	Layer &layer = out->layer;
+	layer.offset_ = src.offset_;
+	layer.visible_ = src.visible_;
+	layer.opacity_ = src.opacity_;
+	layer.blend_mode_ = src.blend_mode_;
+	layer.tile_mode_ = src.tile_mode_;
+	std::vector<PanelPtr const *> panels;
+	src.findPanels(r.translated(-src.offset()), &panels);
+	out->sources.reserve(panels.size());
+	layer.panels_.reserve(panels.size());
+	for (PanelPtr const *p : panels) {
+		out->sources.push_back(*p);
+		if (layer.tile_mode_) {
+			QPoint o = p->offset();
+			layer.tile_index_[Layer::tileKey(o.x(), o.y())] = layer.panels_.size();
+		}
+		if (Image const *image = p->image()) {
+			// 追い出しで元の image_ が差し替えられても影響しないよう、画像は共有コピーを持つ
+			PanelPtr copy = PanelPtr::makeImage();
+			copy->setOffset(image->offset());
+			copy->image_ = TileStore::acquire(&image->swap_, image->image_);
+			layer.panels_.push_back(copy);
+		} else {
+			layer.panels_.push_back(*p);
+		}
+	}
+}
+
+void Document::moveLayer(int from, int to, QMutex *sync)
+{
+	if (from < 0 || from >= layerCount()) return;
+	if (to < 0 || to >= layerCount()) return;
+	if (from == to) return;
+	beginUndoStep();
+	recordLayerStack();
+	if (sync) sync->lock();
+	Layer *current = current_layer();
+	std::shared_ptr<Layer> layer = m->layers[from];
+	m->layers.erase(m->layers.begin() + from);
+	m->layers.insert(m->layers.begin() + to, layer);
+	for (int i = 0; i < layerCount(); i++) {
+		if (m->layers[i].get() == current) {
+			m->current_layer = i;
+		}
+	}
+	m->layers_version = Layer::newVersion();
+	if (sync) sync->unlock();
+	endUndoStep(sync);
+}
+
+// レイヤーの属性は描画スレッドが sync をロックして読む（singleLayer, compositeTile, renderReduced など）
+void Document::setLayerVisible(int index, bool visible, QMutex *sync)
+{
+	Layer *p = layer(index);
+	if (!p || p->visible_ == visible) return;
+	if (sync) sync->lock();
+	p->visible_ = visible;
+	m->layers_version = Layer::newVersion();
+	if (sync) sync->unlock();
+}
+
+void Document::setLayerOpacity(int index, int opacity, QMutex *sync)
+{
+	Layer *p = layer(index);
+	opacity = std::max(0, std::min(opacity, 255));
+	if (!p || p->opacity_ == opacity) return;
+	if (sync) sync->lock();
+	p->opacity_ = opacity;
+	m->layers_version = Layer::newVersion();
+	if (sync) sync->unlock();
+}
+
+void Document::setLayerBlendMode(int index, BlendMode mode, QMutex *sync)
+{
+	Layer *p = layer(index);
+	if (!p || p->blend_mode_ == mode) return;
+	if (sync) sync->lock();
+	p->blend_mode_ = mode;
+	m->layers_version = Layer::newVersion();
+	if (sync) sync->unlock();
+}
+
+void Document::setFixedPoint(bool fixed, QMutex *sync)
+{
+	{
+		QMutexLocker lock(&m->composite_mutex);
+		if (m->fixed_point == fixed) return;
+		m->fixed_point = fixed;
+	}
+	if (sync) sync->lock();
+	m->layers_version = Layer::newVersion(); // 合成結果をすべて作り直す
+	if (sync) sync->unlock();
+}
+
+bool Document::isFixedPoint() const
+{
+	QMutexLocker lock(&m->composite_mutex);
+	return m->fixed_point;
+}
+
+uint64_t Document::version() const
+{
+	return Layer::currentVersion();
+}
+
+// since より後に変更された範囲（ドキュメント座標）。全体が変更されたときは false
+bool Document::changedRegion(uint64_t since, QRegion *out) const
+{
+	QRegion &region = *out;
+	region = QRegion();
+	if (m->layers_version > since) return false;
+	std::vector<uint64_t> keys;
+	for (auto const &layer : m->layers) {
+		if (!layer->changedTiles(since, &keys)) return false;
+		if (keys.size() > 1024) { // 細かく分けても無駄なので外接矩形にまとめる
+			QRect r;
+			for (uint64_t key : keys) {
+				r = r.united(QRect(Layer::tilePos(key), QSize(64, 64)));
+			}
+			region |= r.translated(layer->offset());
+			continue;
+		}
+		for (uint64_t key : keys) {
+			region |= QRect(Layer::tilePos(key) + layer->offset(), QSize(64, 64));
+		}
+	}
+	return true;
+}
+
+QRegion Document::changedRegion(uint64_t since) const
+{
+	QRegion region;
+	if (!changedRegion(since, &region)) {
+		return QRect(QPoint(), size());
+	}
+	return region;
+}
+
+// 前回から変更された範囲の合成キャッシュを捨てる
+void Document::syncComposite() const
+{
+	const uint64_t v = version();
+	QMutexLocker lock(&m->composite_mutex);
+	if (v == m->composite_version) return;
+	QRegion region;
+	bool partial = changedRegion(m->composite_version, &region);
+	m->composite_version = v;
+	if (partial && region.isEmpty()) return;
+	m->composite_generation++;
+	if (!partial) {
+		m->composite.clear();
+		return;
+	}
+	for (auto it = m->composite.begin(); it != m->composite.end(); ) {
+		if (region.intersects(QRect(Layer::tilePos(it->first), QSize(64, 64)))) {
+			it = m->composite.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+// 合成するまでもなく1枚のレイヤーをそのまま描けばよいとき、そのレイヤーを返す
+Document::Layer const *Document::singleLayer() const
+{
+	Layer const *single = nullptr;
+	for (auto const &layer : m->layers) {
+		if (!layer->visible_) continue;
+		if (single) return nullptr;
+		if (layer->opacity_ != 255 || layer->blend_mode_ != BlendMode::Normal) return nullptr;
+		single = layer.get();
+	}
+	return single;
+}
+
+template <typename T> static void compositeSnapshotsT(std::vector<Document::LayerSnapshot> const &layers, int x, int y, QImage *tile, std::atomic_bool *abort)
+{
+	using Pixel = euclase::PixelRGBA;
+	std::vector<T> acc(64 * 64 * 4);
+	Pixel tmp[64];
+	for (Document::LayerSnapshot const &snapshot : layers) {
+		if (abort && *abort) return;
+		Document::Layer const &layer = snapshot.layer;
+		const int opacity = layer.opacity_;
+		const Document::BlendMode mode = layer.blend_mode_;
+		const QRect r(QPoint(x, y) - layer.offset(), QSize(64, 64));
+		std::vector<Document::PanelPtr const *> panels;
+		layer.findPanels(r, &panels);
+		for (Document::PanelPtr const *panel : panels) {
+			const QRect q = QRect(panel->offset(), panel->size()).intersected(r);
+			if (q.isEmpty()) continue;
+			const int ax = q.x() - r.x();
+			const int ay = q.y() - r.y();
+			if (Document::Block const *block = panel->block()) {
+				if (!block->isRGBA8888() || block->isTransparent()) continue;
+				Pixel color(block->value_[0], block->value_[1], block->value_[2], block->value_[3]);
+				for (int i = 0; i < q.height(); i++) {
+					AlphaBlend::accumulate_premultiplied(&acc[((ay + i) * 64 + ax) * 4], color, opacity, q.width(), mode);
+				}
+			} else if (Document::Image const *image = panel->image()) {
+				QImage const &src = image->image_;
+				const int sx = q.x() - panel->offset().x();
+				const int sy = q.y() - panel->offset().y();
+				for (int i = 0; i < q.height(); i++) {
+					// 行の先頭は形式を確かめてから求める（Grayscale8 は 1 バイト/画素）
+					Pixel const *s = tmp;
+					if (src.format() == QImage::Format_Grayscale8) {
+						// 選択範囲と同じく、白をマスクで塗ったものとして扱う
+						uint8_t const *g = src.constScanLine(sy + i) + sx;
+						for (int j = 0; j < q.width(); j++) {
+							tmp[j] = Pixel(255, 255, 255, g[j]);
+						}
+					} else if (src.format() == QImage::Format_ARGB32 || src.format() == QImage::Format_RGB32) {
+						Pixel const *p = reinterpret_cast<Pixel const *>(src.constScanLine(sy + i)) + sx;
+						for (int j = 0; j < q.width(); j++) {
+							tmp[j] = p[j];
+							std::swap(tmp[j].r, tmp[j].b);
+							if (src.format() == QImage::Format_RGB32) tmp[j].a = 255;
+						}
+					} else if (src.format() == QImage::Format_RGBA8888) {
+						s = reinterpret_cast<Pixel const *>(src.constScanLine(sy + i)) + sx;
+					} else {
+						continue;
+					}
+					AlphaBlend::accumulate_premultiplied(&acc[((ay + i) * 64 + ax) * 4], s, opacity, q.width(), mode);
+				}
+			}
+		}
+	}
+	const bool premultiplied = tile->format() == QImage::Format_RGBA8888_Premultiplied;
+	for (int i = 0; i < 64; i++) {
+		storeAccumulated(reinterpret_cast<Pixel *>(tile->scanLine(i)), &acc[i * 64 * 4], 64, premultiplied);
+	}
+}
+
+// タイル (x, y) に layers を重ねる。リニア空間・乗算済みアルファで蓄積するので、重ねるときに除算しない
+// tile は 64x64 の Format_RGBA8888 か Format_RGBA8888_Premultiplied
+// fixed なら固定小数点で計算する（どの環境でも同じ結果になる）
+void Document::compositeSnapshots(std::vector<LayerSnapshot> const &layers, int x, int y, bool fixed, QImage *tile, std::atomic_bool *abort)
+{
+	if (fixed) {
+		compositeSnapshotsT<AlphaBlend::fixed_t>(layers, x, y, tile, abort);
+	} else {
+		compositeSnapshotsT<float>(layers, x, y, tile, abort);
+	}
+}
+
+// 合成結果のタイル。表示用（乗算済み）はキャッシュする
+QImage Document::compositeTile(int x, int y, bool premultiplied, QMutex *sync, std::atomic_bool *abort) const
+{
+	const uint64_t key = Layer::tileKey(x, y);
+	uint64_t generation;
+	bool fixed;
+	{
+		QMutexLocker lock(&m->composite_mutex);
+		if (premultiplied) {
+			auto it = m->composite.find(key);
+			if (it != m->composite.end()) return it->second;
+		}
+		generation = m->composite_generation;
+		fixed = m->fixed_point;
+	}
+
+	std::vector<LayerSnapshot> layers;
+	if (sync) sync->lock();
+	layers.reserve(m->layers.size());
+	for (auto const &layer : m->layers) {
+		if (!layer->visible_ || layer->opacity_ < 1) continue;
+		layers.emplace_back();
+		takeSnapshot(*layer, QRect(x, y, 64, 64), &layers.back());
+	}
+	if (sync) sync->unlock();
+
+	QImage tile = TileAllocator::newTileImage(64, 64, premultiplied ? QImage::Format_RGBA8888_Premultiplied : QImage::Format_RGBA8888);
+	compositeSnapshots(layers, x, y, fixed, &tile, abort);
+	if (abort && *abort) return {};
+	if (!premultiplied) return tile;
+
+	// 合成中に編集されていたら保存しない
+	QMutexLocker lock(&m->composite_mutex);
+	if (generation == m->composite_generation) {
+		if (m->composite.size() >= MAX_COMPOSITE_TILES) {
+			m->composite.clear();
+		}
+		m->composite[key] = tile;
+	}
+	return tile;
+}
+
+// renderToSinglePanel の1行分の処理
+// (入力の形式, 出力の形式, 直接コピー, マスクの有無, 不透明度 == 255) の組み合わせごとにテンプレートで特殊化し、
+// 行のループの中では分岐しないようにする
+
+enum RowFormat {
+	RowRGBA8888,
+	RowARGB32,
+	RowRGB32,
+	RowGray8,
+};
+
+struct RowArgs {
+	void const *src = nullptr;
+	void *dst = nullptr;
+	uint8_t const *msk = nullptr; // マスク（無いときは null）
+	int w = 0;
+	int opacity = 255;
+	uint8_t invert = 0; // Gray8 入力を反転する
+	euclase::PixelRGBA color; // Gray8 入力を塗る色
+	AlphaBlend::GammaMethod gamma = AlphaBlend::GammaMethod::Auto;
+	uint8_t *opacity_mask = nullptr; // 全画素が opacity
+	euclase::PixelRGBA *scratch = nullptr; // w 画素の作業領域
+	uint8_t *alpha = nullptr; // w 画素の作業領域
+	AlphaBlend::SpanBlendFunc blend = nullptr; // 合成モードごとの1行分の合成関数
+};
+
+using RowKernel = void (*)(RowArgs const &);
+
+static int rowSourceFormat(QImage::Format format)
+{
+	switch (format) {
+	case QImage::Format_RGBA8888: return RowRGBA8888;
+	case QImage::Format_ARGB32: return RowARGB32;
+	case QImage::Format_RGB32: return RowRGB32;
+	case QImage::Format_Grayscale8: return RowGray8;
+	default: return -1;
+	}
+}
+
+static int rowTargetFormat(QImage::Format format)
+{
+	switch (format) {
+	case QImage::Format_RGBA8888: return RowRGBA8888;
+	case QImage::Format_Grayscale8: return RowGray8;
+	default: return -1;
+	}
+}
+
+template <int SRC> static inline euclase::PixelRGBA loadRowPixel(void const *src, int j)
+{
+	euclase::PixelRGBA p = reinterpret_cast<euclase::PixelRGBA const *>(src)[j];
+	if (SRC == RowARGB32 || SRC == RowRGB32) std::swap(p.r, p.b);
+	if (SRC == RowRGB32) p.a = 255;
+	return p;
+}
+
+// 直接コピーで選択範囲が一部だけのときは、マスクの値で出力と入力を混ぜる（0 は残し、255 は写す）
+static inline euclase::PixelRGBA copyMasked(euclase::PixelRGBA const &d, euclase::PixelRGBA const &s, int m)
+{
+	auto mix = [&](int a, int b){
+		return (uint8_t)((a * (255 - m) + b * m + 127) / 255);
+	};
+	return euclase::PixelRGBA(mix(d.r, s.r), mix(d.g, s.g), mix(d.b, s.b), mix(d.a, s.a));
+}
+
+template <int SRC, int DST, bool COPY, bool MASKED, bool OPAQUE> static void renderRow(RowArgs const &a)
 {
+	using Pixel = euclase::PixelRGBA;
+	const int w = a.w;
+
+	if (SRC == RowGray8) {
+		// 画素ごとのアルファは opacity * (src ^ invert) * mask / (255 * 255)
+		uint8_t const *src = reinterpret_cast<uint8_t const *>(a.src);
+		uint8_t *alpha = a.alpha;
+		for (int j = 0; j < w; j++) {
+			const int v = src[j] ^ a.invert;
+			if (OPAQUE) {
+				alpha[j] = MASKED ? v * a.msk[j] / 255 : v;
+			} else {
+				alpha[j] = MASKED ? a.opacity * v * a.msk[j] / (255 * 255) : a.opacity * v / 255;
+			}
+		}
+		if (DST == RowRGBA8888) {
+			for (int j = 0; j < w; j++) {
+				a.scratch[j] = a.color;
+				a.scratch[j].a = alpha[j];
+			}
+			a.blend(reinterpret_cast<Pixel *>(a.dst), a.scratch, nullptr, w, a.gamma);
+		} else {
+			uint8_t *dst = reinterpret_cast<uint8_t *>(a.dst);
+			const uint8_t l = a.color.gray();
+			for (int j = 0; j < w; j++) {
+				dst[j] = AlphaBlend::blend(euclase::PixelGrayA(dst[j]), euclase::PixelGrayA(l, alpha[j])).l;
+			}
+		}
+		return;
+	}
+
+	if (COPY && DST == RowRGBA8888) {
+		// 直接コピーは不透明度を使わず、マスクだけを適用する
+		Pixel *dst = reinterpret_cast<Pixel *>(a.dst);
+		if (MASKED) {
+			for (int j = 0; j < w; j++) {
+				dst[j] = copyMasked(dst[j], loadRowPixel<SRC>(a.src, j), a.msk[j]);
+			}
+		} else if (SRC == RowRGBA8888) {
+			memcpy(dst, a.src, sizeof(Pixel) * w);
+		} else {
+			for (int j = 0; j < w; j++) {
+				dst[j] = loadRowPixel<SRC>(a.src, j);
+			}
+		}
+		return;
+	}
+
+	// カラー画像の不透明度はマスクに掛けて適用する
+	uint8_t const *msk = nullptr;
+	if (OPAQUE) {
+		msk = MASKED ? a.msk : nullptr;
+	} else if (MASKED) {
+		for (int j = 0; j < w; j++) {
+			a.alpha[j] = a.msk[j] * a.opacity / 255;
+		}
+		msk = a.alpha;
+	} else {
+		msk = a.opacity_mask;
+	}
+
+	if (DST == RowRGBA8888) {
+		Pixel *dst = reinterpret_cast<Pixel *>(a.dst);
+		Pixel const *src = reinterpret_cast<Pixel const *>(a.src);
+		if (SRC != RowRGBA8888) {
+			for (int j = 0; j < w; j++) {
+				a.scratch[j] = loadRowPixel<SRC>(a.src, j);
+			}
+			src = a.scratch;
+		}
+		a.blend(dst, src, msk, w, a.gamma);
+	} else {
+		uint8_t *dst = reinterpret_cast<uint8_t *>(a.dst);
+		for (int j = 0; j < w; j++) {
+			Pixel color = loadRowPixel<SRC>(a.src, j);
+			if (msk) color.a = color.a * msk[j] / 255;
+			euclase::PixelGrayA d(dst[j]);
+			d = AlphaBlend::blend_with_gamma_collection(euclase::PixelRGBA(d), color);
+			dst[j] = d.gray();
+		}
+	}
+}
+
+#define ROW_KERNELS(SRC, DST, COPY) \
+	{ { renderRow<SRC, DST, COPY, false, false>, renderRow<SRC, DST, COPY, false, true> }, \
+	  { renderRow<SRC, DST, COPY, true, false>, renderRow<SRC, DST, COPY, true, true> } }
+
+#define ROW_KERNELS_SRC(SRC) \
+	{ { ROW_KERNELS(SRC, RowRGBA8888, false), ROW_KERNELS(SRC, RowRGBA8888, true) }, \
+	  { ROW_KERNELS(SRC, RowGray8, false), ROW_KERNELS(SRC, RowGray8, false) } }
+
+// [入力][出力(0: RGBA8888, 1: Gray8)][直接コピー][マスクあり][不透明度 == 255]
+// Gray8 への出力と Gray8 の入力は直接コピーでも合成する（従来どおり）
+static RowKernel const row_kernels[4][2][2][2][2] = {
+	ROW_KERNELS_SRC(RowRGBA8888),
+	ROW_KERNELS_SRC(RowARGB32),
+	ROW_KERNELS_SRC(RowRGB32),
+	ROW_KERNELS_SRC(RowGray8),
+};
+
+#undef ROW_KERNELS_SRC
+#undef ROW_KERNELS
+
+static RowKernel rowKernel(int src, int dst, bool copy, bool masked, bool opaque)
+{
+	return row_kernels[src][dst == RowGray8 ? 1 : 0][copy][masked][opaque];
+}
+
+// renderToSinglePanel で使う選択範囲のマスク（要求された範囲 r の分）
+struct Document::Mask {
+	enum State {
+		None,    // マスクなし。全て選択されているときも None にする
+		Empty,   // r の中は何も選択されていない
+		Partial,
+	};
+	State state = None;
+	QImage image; // Partial のとき。r を含む画像
+	QPoint origin; // r の左上の image 上の位置
+
+	bool isNull() const
+	{
+		return state != Partial;
+	}
+
+	uint8_t const *scanLine(int i) const
+	{
+		return image.constScanLine(origin.y() + i) + origin.x();
+	}
+};
+
+void Document::renderToSinglePanel(Image *target_panel, QPoint const &target_offset, Image const *input_panel, QPoint const &input_offset, Layer const *mask_layer, RenderOption const &opt, QColor const &brush_color, int opacity, std::atomic_bool *abort)
+{
+	target_panel->touch();
+	input_panel->touch();
 	const QPoint dst_org = target_offset + target_panel->offset();
 	const QPoint src_org = input_offset + input_panel->offset();
 	int dx0 = dst_org.x();
@@ -93,213 +958,309 @@ void Document::renderToSinglePanel(Image *target_panel, QPoint const &target_off
 	const int dy = y0 - dst_org.y();
 	const int sx = x0 - src_org.x();
 	const int sy = y0 - src_org.y();
-	uint8_t *tmpmask = nullptr;
-	QImage maskimg;
-	if (mask_layer && !mask_layer->panels_.empty()) {
+	const Mask mask = renderMask(QRect(x0, y0, w, h), target_offset, mask_layer, abort);
+	if (mask.state == Mask::Empty) return; // 選択範囲の外
+
+	const int src_format = rowSourceFormat(input_image.format());
+	const int dst_format = rowTargetFormat(target_panel->image_.format());
+	if (src_format < 0 || dst_format < 0) return;
+
+	RowArgs args;
+	args.w = w;
+	args.gamma = opt.gamma;
+	args.blend = AlphaBlend::span_blend_func(opt.blend_mode);
+	args.scratch = (euclase::PixelRGBA *)alloca(sizeof(euclase::PixelRGBA) * w);
+	args.alpha = (uint8_t *)alloca(w);
+	if (src_format == RowGray8) {
+		// 選択範囲などのマスク画像はブラシの色で塗る
+		QColor c = brush_color.isValid() ? brush_color : Qt::white;
+		if (opacity < 0) {
+			opacity = -opacity;
+			args.invert = 255;
+		}
+		args.color = euclase::PixelRGBA(c.red(), c.green(), c.blue());
+	}
+	args.opacity = std::max(0, std::min(opacity, 255));
+	if (!mask.isNull() || args.opacity < 255) {
+		args.opacity_mask = (uint8_t *)alloca(w);
+		memset(args.opacity_mask, args.opacity, w);
+	}
+
+	// 形式などの組み合わせごとの関数はここで一度だけ選ぶ
+	RowKernel kernel = rowKernel(src_format, dst_format, opt.mode == RenderOption::DirectCopy, !mask.isNull(), args.opacity == 255);
+
+	const int src_bpp = src_format == RowGray8 ? 1 : 4;
+	const int dst_bpp = dst_format == RowGray8 ? 1 : 4;
+	for (int i = 0; i < h; i++) {
+		args.src = input_image.constScanLine(sy + i) + sx * src_bpp;
+		args.dst = target_panel->image_.scanLine(dy + i) + dx * dst_bpp;
+		args.msk = mask.isNull() ? nullptr : mask.scanLine(i);
+		kernel(args);
+	}
+}
+
+// マスクの1タイル分のキャッシュ
+// ブラシの1回の描画では、同じ出力タイルのマスクが入力パネルの数だけ要求されるので、
+// 出力側で 64 に揃えたタイルごとに作ったマスクを、マスクのレイヤーのバージョンと組にして覚えておく
+struct MaskCacheEntry {
+	Document::Layer const *layer = nullptr;
+	QPoint shift; // target_offset - mask_layer->offset()
+	QPoint tile;  // 出力側の座標で 64 に揃えたタイルの左上
+	uint64_t version = 0;
+	Document::Mask::State state = Document::Mask::None;
+	QImage image; // Partial のとき 64x64
+};
+
+static QMutex mask_cache_mutex;
+static std::vector<MaskCacheEntry> mask_cache; // 古いものから順に並ぶ
+
+// マスクのレイヤーの範囲 r（レイヤーの座標）が最後に変更されたバージョン
+static uint64_t maskVersion(Document::Layer const *layer, QRect const &r)
+{
+	uint64_t v = layer->full_version_;
+	if (layer->tile_mode_) {
+		for (int y = r.top() & ~63; y <= r.bottom(); y += 64) {
+			for (int x = r.left() & ~63; x <= r.right(); x += 64) {
+				v = std::max(v, layer->tileVersion(x, y));
+			}
+		}
+	}
+	return v;
+}
+
+static Document::Mask::State classifyMask(QImage const &image)
+{
+	bool all_zero = true;
+	bool all_full = true;
+	for (int y = 0; y < image.height(); y++) {
+		uint8_t const *p = image.constScanLine(y);
+		for (int x = 0; x < image.width(); x++) {
+			all_zero &= p[x] == 0;
+			all_full &= p[x] == 255;
+		}
+		if (!all_zero && !all_full) return Document::Mask::Partial;
+	}
+	return all_full ? Document::Mask::None : Document::Mask::Empty;
+}
+
+Document::Mask Document::renderMask(QRect const &r, QPoint const &target_offset, Layer const *mask_layer, std::atomic_bool *abort)
+{
+	Mask mask;
+	if (!mask_layer || mask_layer->panels_.empty()) return mask;
+
+	auto render = [&](QRect const &rect){
 		Image panel;
-		panel.setOffset(x0, y0);
-		panel.image_ = QImage(w, h, QImage::Format_Grayscale8);
+		panel.setOffset(rect.topLeft());
+		panel.image_ = QImage(rect.size(), QImage::Format_Grayscale8);
 		panel.image_.fill(Qt::black);
 		renderToEachPanels_(&panel, target_offset, *mask_layer, nullptr, Qt::white, 255, abort);
-		maskimg = panel.image_;
-	} else {
-		tmpmask = (uint8_t *)alloca(w);
-		memset(tmpmask, 255, w);
+		return panel.image_;
+	};
+
+	// 1つのタイルに収まらない範囲や、バージョンを持たないレイヤー（写しなど）はキャッシュしない
+	const QRect tile(r.x() & ~63, r.y() & ~63, 64, 64);
+	const QPoint shift = target_offset - mask_layer->offset();
+	const uint64_t version = tile.contains(r) ? maskVersion(mask_layer, tile.translated(shift)) : 0;
+	if (version == 0) {
+		mask.image = render(r);
+		mask.state = (abort && *abort) ? Mask::Empty : classifyMask(mask.image);
+		if (mask.state != Mask::Partial) mask.image = QImage();
+		return mask;
+	}
+	mask.origin = r.topLeft() - tile.topLeft();
+
+	{
+		QMutexLocker lock(&mask_cache_mutex);
+		for (MaskCacheEntry const &e : mask_cache) {
+			if (e.layer == mask_layer && e.shift == shift && e.tile == tile.topLeft() && e.version == version) {
+				mask.state = e.state;
+				mask.image = e.image;
+				return mask;
+			}
+		}
+	}
+
+	QImage image = render(tile);
+	if (abort && *abort) { // 中断したときは何も描かない
+		mask.state = Mask::Empty;
+		return mask;
+	}
+	mask.state = classifyMask(image);
+	if (mask.state == Mask::Partial) mask.image = image;
+
+	QMutexLocker lock(&mask_cache_mutex);
+	for (auto it = mask_cache.begin(); it != mask_cache.end(); ++it) {
+		if (it->layer == mask_layer && it->shift == shift && it->tile == tile.topLeft()) {
+			mask_cache.erase(it); // 古いバージョン
+			break;
+		}
+	}
+	if (mask_cache.size() >= MAX_MASK_TILES) {
+		mask_cache.erase(mask_cache.begin());
 	}
+	MaskCacheEntry e;
+	e.layer = mask_layer;
+	e.shift = shift;
+	e.tile = tile.topLeft();
+	e.version = version;
+	e.state = mask.state;
+	e.image = mask.image;
+	mask_cache.push_back(e);
+	return mask;
+}
+
+void Document::renderToSinglePanel(Image *target_panel, QPoint const &target_offset, Block const *input_panel, QPoint const &input_offset, Layer const *mask_layer, RenderOption const &opt, QColor const &brush_color, int opacity, std::atomic_bool *abort)
+{
+	target_panel->touch();
+	const QPoint dst_org = target_offset + target_panel->offset();
+	const QPoint src_org = input_offset + input_panel->offset();
+	const QRect r = QRect(dst_org, target_panel->image_.size()).intersected(QRect(src_org, input_panel->size_));
+	if (r.isEmpty()) return;
 
-	if (input_image.format() == QImage::Format_Grayscale8) {
-		QImage const &selection = input_image;
+	const int w = r.width();
+	const int h = r.height();
+	const int dx = r.x() - dst_org.x();
+	const int dy = r.y() - dst_org.y();
 
+	// 画素ごとのアルファは alpha_num * mask / alpha_den
+	euclase::PixelRGBA color;
+	int alpha_num;
+	int alpha_den;
+	if (input_panel->isGrayscale8()) {
 		QColor c = brush_color.isValid() ? brush_color : Qt::white;
-
 		uint8_t invert = 0;
 		if (opacity < 0) {
 			opacity = -opacity;
 			invert = 255;
 		}
-
-		if (target_panel->isRGBA8888()) {
-			euclase::PixelRGBA color(c.red(), c.green(), c.blue());
-			for (int i = 0; i < h; i++) {
-				using Pixel = euclase::PixelRGBA;
-				uint8_t const *msk = maskimg.isNull() ? tmpmask : maskimg.scanLine(i);
-				uint8_t const *src = selection.scanLine(sy + i);
-				Pixel *dst = reinterpret_cast<Pixel *>(target_panel->image_.scanLine(dy + i));
-				for (int j = 0; j < w; j++) {
-					color.a = opacity * (src[sx + j] ^ invert) * msk[j] / (255 * 255);
-					dst[dx + j] = AlphaBlend::blend_with_gamma_collection(dst[dx + j], color);
-				}
-			}
-		} else if (target_panel->isGrayscale8()) {
-			euclase::PixelGrayA color(euclase::gray(c.red(), c.green(), c.blue()));
-			uint8_t l = color.l;
-			for (int i = 0; i < h; i++) {
-				using Pixel = euclase::PixelGrayA;
-				uint8_t const *msk = maskimg.isNull() ? tmpmask : maskimg.scanLine(i);
-				uint8_t const *src = reinterpret_cast<uint8_t const *>(selection.scanLine(sy + i));
-				uint8_t *dst = reinterpret_cast<uint8_t *>(target_panel->image_.scanLine(dy + i));
-				for (int j = 0; j < w; j++) {
-					uint8_t a = opacity * (src[sx + j] ^ invert) * msk[j] / (255 * 255);
-					dst[dx + j] = AlphaBlend::blend(Pixel(dst[dx + j]), Pixel(l, a)).l;
-				}
-			}
-		}
+		color = euclase::PixelRGBA(c.red(), c.green(), c.blue());
+		alpha_num = opacity * (input_panel->value_[0] ^ invert);
+		alpha_den = 255 * 255;
+	} else if (input_panel->isRGBA8888()) {
+		color = euclase::PixelRGBA(input_panel->value_[0], input_panel->value_[1], input_panel->value_[2], input_panel->value_[3]);
+		alpha_num = color.a * std::max(0, std::min(opacity, 255));
+		alpha_den = 255 * 255;
+	} else {
 		return;
 	}
+	// Gray8 への出力は、Image の入力と同じく直接コピーでも合成する
+	const bool copy = opt.mode == RenderOption::DirectCopy && input_panel->isRGBA8888() && target_panel->isRGBA8888();
+	if (alpha_num == 0 && !copy) return;
 
-	if (target_panel->isRGBA8888()) {
-
-		auto RenderRGBA8888 = [](euclase::PixelRGBA const *src, euclase::PixelRGBA *dst, uint8_t const *msk, int w, RenderOption const &opt){
-			if (opt.mode == RenderOption::DirectCopy) {
-				memcpy(dst, src, sizeof(euclase::PixelRGBA) * w);
-			} else {
-				for (int j = 0; j < w; j++) {
-					euclase::PixelRGBA color = src[j];
-					color.a = color.a * msk[j] / 255;
-					dst[j] = AlphaBlend::blend_with_gamma_collection(dst[j], color);
-				}
-			}
-		};
-
-		auto RenderARGB32 = [](euclase::PixelRGBA const *src, euclase::PixelRGBA *dst, uint8_t const *msk, int w, RenderOption const &opt){
-			if (opt.mode == RenderOption::DirectCopy) {
-				for (int j = 0; j < w; j++) {
-					euclase::PixelRGBA color = src[j];
-					std::swap(color.r, color.b);
-					dst[j] = color;
-				}
-			} else {
-				for (int j = 0; j < w; j++) {
-					euclase::PixelRGBA color = src[j];
-					std::swap(color.r, color.b);
-					color.a = color.a * msk[j] / 255;
-					dst[j] = AlphaBlend::blend_with_gamma_collection(dst[j], color);
-				}
-			}
-		};
+	const Mask mask = renderMask(r, target_offset, mask_layer, abort);
+	if (mask.state == Mask::Empty) return; // 選択範囲の外
 
-		auto RenderRGB32 = [](euclase::PixelRGBA const *src, euclase::PixelRGBA *dst, uint8_t const *msk, int w, RenderOption const &opt){
-			if (opt.mode == RenderOption::DirectCopy) {
-				for (int j = 0; j < w; j++) {
-					euclase::PixelRGBA color = src[j];
-					std::swap(color.r, color.b);
-					color.a = 255;
-					dst[j] = color;
-				}
+	if (copy) {
+		// Image の入力と同じく、不透明度は使わずマスクだけを適用する
+		for (int i = 0; i < h; i++) {
+			euclase::PixelRGBA *dst = reinterpret_cast<euclase::PixelRGBA *>(target_panel->image_.scanLine(dy + i)) + dx;
+			if (mask.isNull()) {
+				std::fill(dst, dst + w, color);
 			} else {
+				uint8_t const *msk = mask.scanLine(i);
 				for (int j = 0; j < w; j++) {
-					euclase::PixelRGBA color = src[j];
-					std::swap(color.r, color.b);
-					color.a = 255;
-					color.a = color.a * msk[j] / 255;
-					dst[j] = AlphaBlend::blend_with_gamma_collection(dst[j], color);
+					dst[j] = copyMasked(dst[j], color, msk[j]);
 				}
 			}
-		};
-
-		std::function<void(euclase::PixelRGBA const *src, euclase::PixelRGBA *dst, uint8_t const *msk, int w, RenderOption const &opt)> renderer;
-
-		if (input_image.format() == QImage::Format_RGBA8888) {
-			renderer = RenderRGBA8888;
-		} else if (input_image.format() == QImage::Format_ARGB32) {
-			renderer = RenderARGB32;
-		} else if (input_image.format() == QImage::Format_RGB32) {
-			renderer = RenderRGB32;
 		}
+		return;
+	}
+	const bool opaque = mask.isNull() && alpha_num * 255 / alpha_den == 255;
 
-		if (renderer) {
+	if (target_panel->isRGBA8888()) {
+		if (opaque && opt.blend_mode == BlendMode::Normal) {
+			color.a = 255;
 			for (int i = 0; i < h; i++) {
-				uint8_t const *msk = maskimg.isNull() ? tmpmask : maskimg.scanLine(i);
-				euclase::PixelRGBA const *src = reinterpret_cast<euclase::PixelRGBA const *>(input_image.scanLine(sy + i));
-				euclase::PixelRGBA *dst = reinterpret_cast<euclase::PixelRGBA *>(target_panel->image_.scanLine(dy + i));
-				renderer(src + sx, dst + dx, msk, w, opt);
+				euclase::PixelRGBA *dst = reinterpret_cast<euclase::PixelRGBA *>(target_panel->image_.scanLine(dy + i)) + dx;
+				std::fill(dst, dst + w, color);
 			}
 			return;
 		}
-	}
-
-	if (target_panel->isGrayscale8()) {
-
-		auto RenderRGBA8888 = [](euclase::PixelRGBA const *src, uint8_t *dst, uint8_t const *msk, int w, RenderOption const &opt){
-			for (int j = 0; j < w; j++) {
-				euclase::PixelRGBA color = src[j];
-				color.a = color.a * msk[j] / 255;
-				euclase::PixelGrayA d(dst[j]);
-				d = AlphaBlend::blend_with_gamma_collection(euclase::PixelRGBA(d), color);
-				dst[j] = d.gray();
+		AlphaBlend::SpanBlendFunc blend = AlphaBlend::span_blend_func(opt.blend_mode);
+		euclase::PixelRGBA *row = (euclase::PixelRGBA *)alloca(sizeof(euclase::PixelRGBA) * w);
+		color.a = alpha_num * 255 / alpha_den;
+		std::fill(row, row + w, color);
+		for (int i = 0; i < h; i++) {
+			euclase::PixelRGBA *dst = reinterpret_cast<euclase::PixelRGBA *>(target_panel->image_.scanLine(dy + i)) + dx;
+			if (!mask.isNull()) {
+				uint8_t const *msk = mask.scanLine(i);
+				for (int j = 0; j < w; j++) {
+					row[j].a = alpha_num * msk[j] / alpha_den;
+				}
 			}
-		};
-
-		auto RenderARGB32 = [](euclase::PixelRGBA const *src, uint8_t *dst, uint8_t const *msk, int w, RenderOption const &opt){
-			for (int j = 0; j < w; j++) {
-				euclase::PixelRGBA color = src[j];
-				std::swap(color.r, color.b);
-				color.a = color.a * msk[j] / 255;
-				euclase::PixelGrayA d(dst[j]);
-				d = AlphaBlend::blend_with_gamma_collection(euclase::PixelRGBA(d), color);
-				dst[j] = d.gray();
+			blend(dst, row, nullptr, w, opt.gamma);
+		}
+	} else if (target_panel->isGrayscale8()) {
+		const uint8_t l = color.gray();
+		for (int i = 0; i < h; i++) {
+			uint8_t *dst = reinterpret_cast<uint8_t *>(target_panel->image_.scanLine(dy + i)) + dx;
+			if (opaque) {
+				memset(dst, l, w);
+				continue;
 			}
-		};
-
-		auto RenderRGB32 = [](euclase::PixelRGBA const *src, uint8_t *dst, uint8_t const *msk, int w, RenderOption const &opt){
+			uint8_t const *msk = mask.isNull() ? nullptr : mask.scanLine(i);
 			for (int j = 0; j < w; j++) {
-				euclase::PixelRGBA color = src[j];
-				std::swap(color.r, color.b);
-				color.a = 255;
-				color.a = color.a * msk[j] / 255;
-				euclase::PixelGrayA d(dst[j]);
-				d = AlphaBlend::blend_with_gamma_collection(d, color);
-				dst[j] = d.gray();
-			}
-		};
-
-		std::function<void(euclase::PixelRGBA const *src, uint8_t *dst, uint8_t const *msk, int w, RenderOption const &opt)> renderer;
-
-		if (input_image.format() == QImage::Format_RGBA8888) {
-			renderer = RenderRGBA8888;
-		} else if (input_image.format() == QImage::Format_ARGB32) {
-			renderer = RenderARGB32;
-		} else if (input_image.format() == QImage::Format_RGB32) {
-			renderer = RenderRGB32;
-		}
-
-		if (renderer) {
-			for (int i = 0; i < h; i++) {
-				uint8_t const *msk = maskimg.isNull() ? tmpmask : maskimg.scanLine(i);
-				euclase::PixelRGBA const *src = reinterpret_cast<euclase::PixelRGBA const *>(input_image.scanLine(sy + i));
-				uint8_t *dst = reinterpret_cast<uint8_t *>(target_panel->image_.scanLine(dy + i));
-				renderer(src + sx, dst + dx, msk, w, opt);
+				color.a = alpha_num * (msk ? msk[j] : 255) / alpha_den;
+				if (input_panel->isGrayscale8()) {
+					dst[j] = AlphaBlend::blend(euclase::PixelGrayA(dst[j]), euclase::PixelGrayA(l, color.a)).l;
+				} else {
+					euclase::PixelGrayA d(dst[j]);
+					d = AlphaBlend::blend_with_gamma_collection(euclase::PixelRGBA(d), color);
+					dst[j] = d.gray();
+				}
 			}
-			return;
 		}
 	}
-
 }
 
-void Document::renderToEachPanels_(Image *target_panel, QPoint const &target_offset, Layer const &input_layer, Layer *mask_layer, QColor const &brush_color, int opacity, bool *abort)
+void Document::renderToEachPanels_(Image *target_panel, QPoint const &target_offset, Layer const &input_layer, Layer *mask_layer, QColor const &brush_color, int opacity, std::atomic_bool *abort)
 {
 	if (mask_layer && mask_layer->panels_.empty()) {
 		mask_layer = nullptr;
 	}
-	for (PanelPtr const &input_panel : input_layer.panels_) {
+	QRect r(target_panel->offset() + target_offset - input_layer.offset(), QSize(target_panel->width(), target_panel->height()));
+	std::vector<PanelPtr const *> panels;
+	input_layer.findPanels(r, &panels);
+	for (PanelPtr const *input_panel : panels) {
 		if (abort && *abort) return;
 		RenderOption opt;
-		renderToSinglePanel(target_panel, target_offset, input_panel.image(), input_layer.offset(), mask_layer, opt, brush_color, opacity);
+		if (Image const *image = input_panel->image()) {
+			renderToSinglePanel(target_panel, target_offset, image, input_layer.offset(), mask_layer, opt, brush_color, opacity);
+		} else if (Block const *block = input_panel->block()) {
+			renderToSinglePanel(target_panel, target_offset, block, input_layer.offset(), mask_layer, opt, brush_color, opacity);
+		}
 	}
 }
 
-void Document::renderToEachPanels(Image *target_panel, QPoint const &target_offset, Layer const &input_layer, Layer *mask_layer, QColor const &brush_color, int opacity, QMutex *sync, bool *abort)
+void Document::renderToEachPanels(Image *target_panel, QPoint const &target_offset, Layer const &input_layer, Layer *mask_layer, QColor const &brush_color, int opacity, QMutex *sync, std::atomic_bool *abort)
 {
 	if (sync) {
-		QMutexLocker lock(sync);
-		renderToEachPanels(target_panel, target_offset, input_layer, mask_layer, brush_color, opacity, nullptr, abort);
+		// 写しを取る間だけロックし、描画はロックの外で行う
+		const QRect r(target_panel->offset() + target_offset, QSize(target_panel->width(), target_panel->height()));
+		LayerSnapshot input;
+		LayerSnapshot mask;
+		{
+			QMutexLocker lock(sync);
+			takeSnapshot(input_layer, r, &input);
+			if (mask_layer && !mask_layer->panels_.empty()) {
+				takeSnapshot(*mask_layer, r, &mask);
+				if (mask.layer.panels_.empty()) { // 範囲内は何も選択されていない
+					PanelPtr block = PanelPtr::makeBlock();
+					block.block()->format_ = QImage::Format_Grayscale8;
+					block.block()->size_ = r.size();
+					block.block()->setOffset(r.topLeft() - mask.layer.offset());
+					mask.layer.panels_.push_back(block);
+				}
+			}
+		}
+		renderToEachPanels_(target_panel, target_offset, input.layer, mask.layer.panels_.empty() ? nullptr : &mask.layer, brush_color, opacity, abort);
 		return;
 	}
 
 	renderToEachPanels_(target_panel, target_offset, input_layer, mask_layer, brush_color, opacity, abort);
 }
 
-void Document::renderToLayer(Layer *target_layer, Layer const &input_layer, Layer *mask_layer, RenderOption const &opt, QMutex *sync, bool *abort)
+void Document::renderToLayer(Layer *target_layer, Layer const &input_layer, Layer *mask_layer, RenderOption const &opt, QMutex *sync, std::atomic_bool *abort)
 {
 	for (PanelPtr const &input_panel : input_layer.panels_) {
 		if (input_panel.isImage()) {
@@ -308,42 +1269,18 @@ void Document::renderToLayer(Layer *target_layer, Layer const &input_layer, Laye
 				QPoint s1 = s0 + QPoint(input_panel->width(), input_panel->height());
 				for (int y = (s0.y() & ~63); y < s1.y(); y += 64) {
 					for (int x = (s0.x() & ~63); x < s1.x(); x += 64) {
-						auto FindPanel = [](Layer const *layer, int x, int y){
-							int lo = 0;
-							int hi = layer->panels_.size();
-							while (lo < hi) {
-								int m = (lo + hi) / 2;
-								PanelPtr p = layer->panels_[m];
-								Q_ASSERT(p);
-								auto COMP = [](PanelPtr const &p, int x, int y){
-									if (p->offset().y() < y) return -1;
-									if (p->offset().y() > y) return 1;
-									if (p->offset().x() < x) return -1;
-									if (p->offset().x() > x) return 1;
-									return 0;
-								};
-								int i = COMP(p, x, y);
-								if (i == 0) return p;
-								if (i < 0) {
-									lo = m + 1;
-								} else {
-									hi = m;
-								}
-							}
-							return PanelPtr();
-						};
 						if (sync) sync->lock();
-						PanelPtr panel = FindPanel(target_layer, x, y);
-						if (!panel) {
-							panel = target_layer->addImagePanel(x, y, 64, 64);
-							panel.image()->image_.fill(Qt::transparent);
-						}
+						PanelPtr panel = target_layer->writablePanel(x, y);
 						{
-							if (abort && *abort) return;
+							if (abort && *abort) {
+								if (sync) sync->unlock();
+								return;
+							}
 							if (panel.isImage()) {
 								renderToSinglePanel(panel.image(), target_layer->offset(), input_panel.image(), input_layer.offset(), mask_layer, opt, opt.brush_color, 255, abort);
 							}
 						}
+						TileStore::trim(); // 大きな画像を貼り付けるときも上限を超えないように
 						if (sync) sync->unlock();
 					}
 				}
@@ -353,8 +1290,10 @@ void Document::renderToLayer(Layer *target_layer, Layer const &input_layer, Laye
 					if (abort && *abort) return;
 					if (sync) sync->lock();
 					if (panel.isImage()) {
-						RenderOption opt;
-						renderToSinglePanel(panel.image(), target_layer->offset(), input_panel.image(), input_layer.offset(), mask_layer, opt, opt.brush_color, 255, abort);
+						RenderOption o;
+						o.gamma = opt.gamma;
+						o.blend_mode = opt.blend_mode;
+						renderToSinglePanel(panel.image(), target_layer->offset(), input_panel.image(), input_layer.offset(), mask_layer, o, o.brush_color, 255, abort);
 					}
 					if (sync) sync->unlock();
 					count++;
@@ -367,11 +1306,22 @@ void Document::renderToLayer(Layer *target_layer, Layer const &input_layer, Laye
 					target_layer->panels_.push_back(panel);
 					if (sync) sync->unlock();
 				}
+				if (sync) sync->lock();
+				target_layer->markAll();
+				if (sync) sync->unlock();
 			}
 		}
 	}
 }
 
+// 描画スレッドが読み戻したタイルを、常駐メモリの上限まで追い出す
+void Document::trimTiles(QMutex *sync)
+{
+	if (sync) sync->lock();
+	TileStore::trim();
+	if (sync) sync->unlock();
+}
+
 void Document::clearSelection(QMutex *sync)
 {
 	selection_layer()->clear(sync);
@@ -382,29 +1332,48 @@ void Document::clear(QMutex *sync)
 {
 	m->size = QSize();
 	clearSelection(sync);
-	current_layer()->clear(sync);
+	recordLayerStack(); // アンドゥ記録中なら外したレイヤーを履歴に残す
+	std::vector<std::shared_ptr<Layer>> removed;
+	if (sync) sync->lock();
+	while (m->layers.size() > 1) {
+		removed.push_back(m->layers.back());
+		m->layers.pop_back();
+		m->layers_version = Layer::newVersion();
+	}
+	m->current_layer = 0;
+	if (sync) sync->unlock();
+	for (std::shared_ptr<Layer> const &layer : removed) {
+		retireLayer(layer.get());
+	}
+	Layer *layer = current_layer();
+	layer->clear(sync);
+	if (sync) sync->lock();
+	layer->visible_ = true;
+	layer->opacity_ = 255;
+	layer->blend_mode_ = BlendMode::Normal;
+	if (sync) sync->unlock();
 }
 
-void Document::paintToCurrentLayer(Layer const &source, RenderOption const &opt, QMutex *sync, bool *abort)
+void Document::paintToCurrentLayer(Layer const &source, RenderOption const &opt, QMutex *sync, std::atomic_bool *abort)
 {
-	renderToLayer(&m->current_layer, source, selection_layer(), opt, sync, abort);
+	renderToLayer(current_layer(), source, selection_layer(), opt, sync, abort);
 }
 
-void Document::addSelection(Layer const &source, RenderOption const &opt, QMutex *sync, bool *abort)
+void Document::addSelection(Layer const &source, RenderOption const &opt, QMutex *sync, std::atomic_bool *abort)
 {
 	RenderOption o = opt;
 	o.brush_color = Qt::white;
 	renderToLayer(selection_layer(), source, nullptr, o, sync, abort);
 }
 
-void Document::subSelection(Layer const &source, RenderOption const &opt, QMutex *sync, bool *abort)
+void Document::subSelection(Layer const &source, RenderOption const &opt, QMutex *sync, std::atomic_bool *abort)
 {
 	RenderOption o = opt;
 	o.brush_color = Qt::black;
 	renderToLayer(selection_layer(), source, nullptr, o, sync, abort);
 }
 
-QImage Document::renderSelection(const QRect &r, QMutex *sync, bool *abort) const
+QImage Document::renderSelection(const QRect &r, QMutex *sync, std::atomic_bool *abort) const
 {
 	Image panel;
 	panel.image_ = QImage(r.width(), r.height(), QImage::Format_Grayscale8);
@@ -414,20 +1383,237 @@ QImage Document::renderSelection(const QRect &r, QMutex *sync, bool *abort) cons
 	return panel.image_;
 }
 
-QImage Document::renderToLayer(const QRect &r, bool quickmask, QMutex *sync, bool *abort) const
+// 0 から count - 1 までの作業を、呼び出したスレッドとスレッドプールの空いているスレッドで分担する。
+// すぐに動けるスレッドにだけ任せるので、プールのスレッドから呼んでも待ち合わせで止まらない
+static void parallelFor(size_t count, std::atomic_bool *abort, std::function<void(size_t)> const &fn)
+{
+	std::atomic<size_t> next(0);
+	std::function<void()> work = [&](){
+		size_t i;
+		while ((i = next++) < count) {
+			if (abort && *abort) break;
+			fn(i);
+		}
+	};
+
+	class Worker : public QRunnable {
+	public:
+		std::function<void()> const *work;
+		QSemaphore *done;
+		void run() override
+		{
+			(*work)();
+			done->release();
+		}
+	};
+
+	QSemaphore done;
+	QThreadPool *pool = QThreadPool::globalInstance();
+	const int helpers = (int)std::min<size_t>(pool->maxThreadCount(), count) - 1;
+	int started = 0;
+	for (int i = 0; i < helpers; i++) {
+		Worker *w = new Worker;
+		w->work = &work;
+		w->done = &done;
+		if (!pool->tryStart(w)) {
+			delete w;
+			break;
+		}
+		started++;
+	}
+	work();
+	done.acquire(started);
+}
+
+QImage Document::renderToLayer(const QRect &r, bool quickmask, QMutex *sync, std::atomic_bool *abort, QImage::Format format) const
 {
+	const bool premultiplied = format == QImage::Format_RGBA8888_Premultiplied;
 	Image panel;
-	panel.image_ = QImage(r.width(), r.height(), QImage::Format_RGBA8888);
+	panel.image_ = QImage(r.width(), r.height(), premultiplied ? format : QImage::Format_RGBA8888);
 	panel.image_.fill(Qt::transparent);
 	panel.setOffset(r.topLeft());
-	renderToEachPanels(&panel, QPoint(), *current_layer(), nullptr, QColor(), 255, sync, abort);
+	LayerSnapshot single;
+	LayerSnapshot selection;
+	if (sync) sync->lock();
+	Layer const *layer = singleLayer();
+	if (layer) {
+		takeSnapshot(*layer, r, &single);
+	} else {
+		syncComposite();
+	}
 	if (quickmask) {
-		renderToEachPanels(&panel, QPoint(), *selection_layer(), nullptr, QColor(255, 0, 0), -128, sync, abort);
+		takeSnapshot(*selection_layer(), r, &selection);
+	}
+	if (sync) sync->unlock();
+
+	// 64 の倍数に揃えた矩形ごとに分けて並列に描く。各矩形は出力画像の一部を直接指す
+	std::vector<QRect> items;
+	const int x1 = r.x() + r.width();
+	const int y1 = r.y() + r.height();
+	for (int y = r.y() & ~63; y < y1; y += 64) {
+		for (int x = r.x() & ~63; x < x1; x += 64) {
+			items.push_back(QRect(x, y, 64, 64).intersected(r));
+		}
+	}
+	uint8_t *bits = panel.image_.bits();
+	const int bpl = panel.image_.bytesPerLine();
+	parallelFor(items.size(), abort, [&](size_t i){
+		QRect const &q = items[i];
+		Image target;
+		target.image_ = QImage(bits + (q.y() - r.y()) * bpl + (q.x() - r.x()) * 4, q.width(), q.height(), bpl, QImage::Format_RGBA8888);
+		target.setOffset(q.topLeft());
+		bool straight = true; // target の中身が乗算前の値か
+		if (layer) {
+			renderToEachPanels_(&target, QPoint(), single.layer, nullptr, QColor(), 255, abort);
+		} else {
+			// タイル単位で合成結果をキャッシュし、編集されたタイルだけ合成し直す
+			const int x = q.x() & ~63;
+			const int y = q.y() & ~63;
+			QImage tile = compositeTile(x, y, premultiplied, sync, abort);
+			if (tile.isNull()) return;
+			for (int j = 0; j < q.height(); j++) {
+				uint8_t const *src = tile.constScanLine(q.y() - y + j) + (q.x() - x) * 4;
+				memcpy(target.image_.scanLine(j), src, q.width() * 4);
+				if (premultiplied && quickmask) {
+					AlphaBlend::unpremultiply(reinterpret_cast<euclase::PixelRGBA *>(target.image_.scanLine(j)), q.width());
+				}
+			}
+			straight = !premultiplied || quickmask;
+		}
+		if (quickmask) {
+			renderToEachPanels_(&target, QPoint(), selection.layer, nullptr, QColor(255, 0, 0), -128, abort);
+		}
+		if (premultiplied && straight) {
+			for (int j = 0; j < q.height(); j++) {
+				AlphaBlend::premultiply(reinterpret_cast<euclase::PixelRGBA *>(target.image_.scanLine(j)), q.width());
+			}
+		}
+	});
+	return panel.image_;
+}
+
+// mip_mutex と sync をロックして呼ぶ
+std::shared_ptr<Document::MipPyramid> Document::mipmap(Layer const *layer) const
+{
+	std::shared_ptr<MipPyramid> &p = m->mips[layer];
+	if (!p) {
+		p = std::make_shared<MipPyramid>();
+		p->layer = layer;
+		p->mutex = &m->mip_mutex;
+	}
+	p->sync();
+	return p;
+}
+
+// 縮小画像が増えすぎたら、細かいレベルから捨てる
+void Document::trimMipmaps(int keep_level) const
+{
+	auto count = [&](){
+		size_t n = 0;
+		for (auto const &pair : m->mips) {
+			n += pair.second->image_tiles;
+		}
+		return n;
+	};
+	if (count() <= MAX_MIP_TILES) return;
+	for (int level = 1; level <= MAX_MIP_LEVEL; level++) {
+		if (level == keep_level) continue;
+		for (auto &pair : m->mips) {
+			pair.second->dropLevel(level);
+		}
+		if (count() <= MAX_MIP_TILES) return;
+	}
+	for (auto &pair : m->mips) {
+		pair.second->dropLevel(keep_level);
+	}
+}
+
+// ドキュメント座標の r を 1/2^level に縮小して描く
+QImage Document::renderReduced(QRect const &r, int level, QMutex *sync, std::atomic_bool *abort, QImage::Format format) const
+{
+	if (level < 1) return renderToLayer(r, false, sync, abort, format);
+	const bool premultiplied = format == QImage::Format_RGBA8888_Premultiplied;
+	level = std::min(level, MAX_MIP_LEVEL);
+	const int s = 1 << level;
+	const int x0 = r.x() >> level;
+	const int y0 = r.y() >> level;
+	const int x1 = (r.x() + r.width() + s - 1) >> level;
+	const int y1 = (r.y() + r.height() + s - 1) >> level;
+	const QRect lr(x0, y0, x1 - x0, y1 - y0);
+
+	QImage image(lr.size(), premultiplied ? format : QImage::Format_RGBA8888);
+	image.fill(Qt::transparent);
+	const bool fixed = isFixedPoint();
+	std::vector<float> acc(fixed ? 0 : 64 * 64 * 4);
+	std::vector<AlphaBlend::fixed_t> acc_fixed(fixed ? 64 * 64 * 4 : 0);
+	for (int y = y0 & ~63; y < y1; y += 64) {
+		for (int x = x0 & ~63; x < x1; x += 64) {
+			if (abort && *abort) return image;
+			struct Source {
+				std::shared_ptr<MipPyramid> pyramid;
+				int opacity;
+				BlendMode mode;
+			};
+			std::vector<Source> sources;
+			std::vector<MipLayerTile> tiles;
+			{
+				QMutexLocker lock(&m->mip_mutex);
+				if (sync) sync->lock();
+				trimMipmaps(level);
+				for (auto const &layer : m->layers) {
+					if (!layer->visible_ || layer->opacity_ < 1) continue;
+					sources.push_back({mipmap(layer.get()), layer->opacity_, layer->blend_mode_});
+				}
+				if (sync) sync->unlock();
+			}
+			// 足りないタイルはロックせずに作るので、ほかのスレッドの描画を待たせない
+			for (auto const &source : sources) {
+				tiles.push_back({source.pyramid->tile(level, x, y, sync), source.opacity, source.mode});
+			}
+
+			const QRect q = QRect(x, y, 64, 64).intersected(lr);
+			if (fixed) {
+				compositeMipTiles(tiles, &acc_fixed, q.translated(-x, -y), premultiplied, &image, q.topLeft() - lr.topLeft());
+			} else {
+				compositeMipTiles(tiles, &acc, q.translated(-x, -y), premultiplied, &image, q.topLeft() - lr.topLeft());
+			}
+		}
 	}
+	return image;
+}
+
+// レイヤー1枚の範囲 r（ドキュメント座標）。ほかのレイヤーとは合成せず、不透明度なども掛けない
+QImage Document::renderLayer(int index, QRect const &r, QMutex *sync, std::atomic_bool *abort) const
+{
+	Layer const *p = layer(index);
+	if (!p) return {};
+	Image panel;
+	panel.image_ = QImage(r.width(), r.height(), QImage::Format_RGBA8888);
+	panel.image_.fill(Qt::transparent);
+	panel.setOffset(r.topLeft());
+	renderToEachPanels(&panel, QPoint(), *p, nullptr, QColor(), 255, sync, abort);
 	return panel.image_;
 }
 
-QImage Document::crop(const QRect &r, QMutex *sync, bool *abort) const
+// レイヤーの内容を image（左上がドキュメントの原点）で置き換える。ほかのレイヤーには触れない
+// アンドゥの記録中に呼べば、レイヤー全体を置き換えたものとして記録される
+void Document::setLayerImage(int index, QImage const &image, QMutex *sync)
+{
+	Layer *target = layer(index);
+	if (!target) return;
+	target->clear(sync);
+	if (sync) sync->lock();
+	target->tile_mode_ = true;
+	if (sync) sync->unlock();
+
+	Layer source;
+	source.setImage(QPoint(0, 0), image);
+	RenderOption opt;
+	opt.mode = RenderOption::DirectCopy;
+	renderToLayer(target, source, nullptr, opt, sync, nullptr);
+}
+
+QImage Document::crop(const QRect &r, QMutex *sync, std::atomic_bool *abort) const
 {
 	Image panel;
 	panel.image_ = QImage(r.width(), r.height(), QImage::Format_RGBA8888);
@@ -439,14 +1625,392 @@ QImage Document::crop(const QRect &r, QMutex *sync, bool *abort) const
 
 void Document::crop2(const QRect &r)
 {
-	current_layer()->setOffset(current_layer()->offset() - r.topLeft());
+	beginUndoStep();
+	for (auto &layer : m->layers) {
+		layer->setOffset(layer->offset() - r.topLeft());
+	}
 	selection_layer()->setOffset(selection_layer()->offset() - r.topLeft());
 	setSize(r.size());
+	endUndoStep(nullptr);
+}
+
+void Document::beginUndoStep()
+{
+	if (m->undo_depth++ > 0) return;
+
+	m->recording.reset(new UndoStep);
+	m->recording->size = size();
+	std::vector<std::shared_ptr<Layer>> layers = m->layers;
+	layers.emplace_back(std::shared_ptr<Layer>(), selection_layer()); // 所有しない
+	for (std::shared_ptr<Layer> const &layer : layers) {
+		m->recording->layers.emplace_back();
+		LayerJournal *j = &m->recording->layers.back();
+		j->layer = layer.get();
+		j->keep = layer;
+		j->offset = layer->offset();
+		layer->journal_ = j;
+	}
+}
+
+void Document::endUndoStep(QMutex *sync)
+{
+	if (m->undo_depth < 1) return;
+	if (--m->undo_depth > 0) return;
+
+	std::unique_ptr<UndoStep> step = std::move(m->recording);
+	bool empty = (step->size == size() && !step->restacked);
+	for (LayerJournal &j : step->layers) {
+		j.layer->journal_ = nullptr;
+		if (!j.isEmpty()) {
+			empty = false;
+		}
+	}
+	if (empty) return;
+
+	// 書き換えたタイルのうち全画素が同じものを Block にする
+	// ブラシで描いている間は次の描画ですぐ展開し直すことになるので、操作の終わりにまとめて行う
+	if (sync) sync->lock();
+	for (LayerJournal &j : step->layers) {
+		Layer *layer = j.layer;
+		if (!layer->tile_mode_) continue;
+		if (j.replaced) {
+			for (PanelPtr const &panel : layer->panels_) {
+				if (panel.isImage()) {
+					const QPoint pos = panel.offset();
+					layer->compactPanel(pos.x(), pos.y());
+				}
+			}
+		} else {
+			for (auto const &pair : j.tiles) {
+				const QPoint pos = Layer::tilePos(pair.first);
+				layer->compactPanel(pos.x(), pos.y());
+			}
+		}
+	}
+	TileStore::trim();
+	if (sync) sync->unlock();
+
+	m->undo_stack.push_back(std::move(step));
+	if (m->undo_stack.size() > MAX_UNDO_STEPS) {
+		m->undo_stack.erase(m->undo_stack.begin());
+	}
+	m->redo_stack.clear();
+}
+
+bool Document::canUndo() const
+{
+	return m->undo_depth == 0 && !m->undo_stack.empty();
+}
+
+bool Document::canRedo() const
+{
+	return m->undo_depth == 0 && !m->redo_stack.empty();
+}
+
+void Document::swapUndoStep(UndoStep *step, QMutex *sync)
+{
+	std::vector<Layer const *> dropped; // 並びから外れたレイヤー
+	if (sync) sync->lock();
+	for (LayerJournal &j : step->layers) {
+		j.swap();
+	}
+	if (step->restacked) {
+		std::swap(m->layers, step->stack);
+		std::swap(m->current_layer, step->current_layer);
+		for (std::shared_ptr<Layer> const &layer : step->stack) {
+			if (std::find(m->layers.begin(), m->layers.end(), layer) == m->layers.end()) {
+				dropped.push_back(layer.get());
+			}
+		}
+		m->layers_version = Layer::newVersion();
+	}
+	QSize s = size();
+	setSize(step->size);
+	step->size = s;
+	TileStore::trim();
+	if (sync) sync->unlock();
+	for (Layer const *layer : dropped) {
+		retireLayer(layer);
+	}
+}
+
+bool Document::undo(QMutex *sync)
+{
+	if (!canUndo()) return false;
+	std::unique_ptr<UndoStep> step = std::move(m->undo_stack.back());
+	m->undo_stack.pop_back();
+	swapUndoStep(step.get(), sync);
+	m->redo_stack.push_back(std::move(step));
+	return true;
+}
+
+bool Document::redo(QMutex *sync)
+{
+	if (!canRedo()) return false;
+	std::unique_ptr<UndoStep> step = std::move(m->redo_stack.back());
+	m->redo_stack.pop_back();
+	swapUndoStep(step.get(), sync);
+	m->undo_stack.push_back(std::move(step));
+	return true;
+}
+
+void Document::clearUndoHistory()
+{
+	m->undo_stack.clear();
+	m->redo_stack.clear();
+}
+
+Document::PanelPtr *Document::Layer::findPanel(int x, int y)
+{
+	auto it = tile_index_.find(tileKey(x, y));
+	if (it == tile_index_.end()) return nullptr;
+	return &panels_[it->second];
+}
+
+void Document::Layer::findPanels(QRect const &r, std::vector<PanelPtr const *> *out) const
+{
+	out->clear();
+	if (r.isEmpty()) return;
+
+	if (tile_mode_) {
+		const int tx0 = r.left() >> 6;
+		const int ty0 = r.top() >> 6;
+		const int tx1 = r.right() >> 6;
+		const int ty1 = r.bottom() >> 6;
+		const int64_t count = int64_t(tx1 - tx0 + 1) * (ty1 - ty0 + 1);
+		if (count <= (int64_t)tile_index_.size()) {
+			for (int ty = ty0; ty <= ty1; ty++) {
+				for (int tx = tx0; tx <= tx1; tx++) {
+					auto it = tile_index_.find(tileKey(tx << 6, ty << 6));
+					if (it != tile_index_.end()) {
+						out->push_back(&panels_[it->second]);
+					}
+				}
+			}
+			return;
+		}
+	}
+
+	// タイル数より範囲が広いときは全走査する
+	for (PanelPtr const &panel : panels_) {
+		QRect pr(panel.offset(), panel.size());
+		if (pr.intersects(r)) {
+			out->push_back(&panel);
+		}
+	}
+}
+
+// 書き込み用のタイルを得る。履歴と共有しているタイルは複製してから返す
+Document::PanelPtr Document::Layer::writablePanel(int x, int y)
+{
+	PanelPtr *p = findPanel(x, y);
+	if (journal_) {
+		journal_->record(tileKey(x, y), p);
+	}
+	if (!p) {
+		return addImagePanel(x, y, 64, 64);
+	}
+	markTile(x, y);
+	if (p->isBlock()) {
+		*p = p->expand();
+	} else {
+		(*p)->touch();
+		if (p->useCount() > 1) {
+			*p = p->copy();
+			(*p)->image_ = TileAllocator::copyTileImage((*p)->image_);
+		}
+	}
+	TileStore::track(&(*p)->swap_, &(*p)->image_);
+	return *p;
+}
+
+// 全画素が同じ値のタイルを Block に置き換える
+bool Document::Layer::compactPanel(int x, int y)
+{
+	PanelPtr *p = findPanel(x, y);
+	if (!p) return false;
+	Image const *image = p->image();
+	if (!image) return false;
+	image->touch();
+	const int w = image->width();
+	const int h = image->height();
+	if (w < 1 || h < 1) return false;
+
+	uint8_t value[4] = {};
+	if (image->isRGBA8888()) {
+		uint32_t v;
+		memcpy(&v, image->image_.scanLine(0), 4);
+		bool transparent = (v & 0xff000000) == 0; // 完全に透明なら色は問わない
+		for (int i = 0; i < h; i++) {
+			uint8_t const *s = image->image_.scanLine(i);
+			if (transparent) {
+				for (int j = 0; j < w; j++) {
+					if (s[j * 4 + 3] != 0) return false;
+				}
+			} else {
+				for (int j = 0; j < w; j++) {
+					if (memcmp(s + j * 4, &v, 4) != 0) return false;
+				}
+			}
+		}
+		if (!transparent) {
+			memcpy(value, image->image_.scanLine(0), 4);
+		}
+	} else if (image->isGrayscale8()) {
+		uint8_t const *s0 = image->image_.scanLine(0);
+		for (int i = 0; i < h; i++) {
+			uint8_t const *s = image->image_.scanLine(i);
+			for (int j = 0; j < w; j++) {
+				if (s[j] != s0[0]) return false;
+			}
+		}
+		value[0] = s0[0];
+	} else {
+		return false;
+	}
+
+	PanelPtr panel = PanelPtr::makeBlock();
+	Block *b = panel.block();
+	b->setOffset(image->offset());
+	b->format_ = image->image_.format();
+	b->size_ = image->image_.size();
+	memcpy(b->value_, value, sizeof(value));
+	*p = panel;
+	return true;
+}
+
+Document::PanelPtr Document::PanelPtr::expand() const
+{
+	Block const *b = block();
+	if (!b) return *this;
+	PanelPtr panel = makeImage();
+	panel->setOffset(b->offset());
+	panel->image_ = TileAllocator::newTileImage(b->width(), b->height(), b->format_);
+	for (int i = 0; i < b->height(); i++) {
+		uint8_t *d = panel->image_.scanLine(i);
+		if (b->isGrayscale8()) {
+			memset(d, b->value_[0], b->width());
+		} else {
+			for (int j = 0; j < b->width(); j++) {
+				memcpy(d + j * 4, b->value_, 4);
+			}
+		}
+	}
+	return panel;
+}
+
+void Document::Layer::setPanel(QPoint const &pos, PanelPtr const &panel)
+{
+	const uint64_t key = tileKey(pos.x(), pos.y());
+	markTile(pos.x(), pos.y());
+	auto it = tile_index_.find(key);
+	if (panel) {
+		if (it != tile_index_.end()) {
+			panels_[it->second] = panel;
+		} else {
+			tile_index_[key] = panels_.size();
+			panels_.push_back(panel);
+		}
+		return;
+	}
+	if (it == tile_index_.end()) return;
+	const size_t i = it->second;
+	const size_t last = panels_.size() - 1;
+	tile_index_.erase(it);
+	if (i != last) {
+		panels_[i] = panels_[last];
+		QPoint o = panels_[i].offset();
+		tile_index_[tileKey(o.x(), o.y())] = i;
+	}
+	panels_.pop_back();
+}
+
+static std::atomic<uint64_t> g_version(0);
+const size_t MAX_CHANGE_LOG = 65536;
+
+uint64_t Document::Layer::newVersion()
+{
+	return ++g_version;
+}
+
+uint64_t Document::Layer::currentVersion()
+{
+	return g_version.load();
+}
+
+void Document::Layer::markTile(int x, int y)
+{
+	const uint64_t key = tileKey(x, y);
+	const uint64_t v = newVersion();
+	tile_versions_[key] = v;
+	if (!changes_.empty() && changes_.back().second == key) {
+		changes_.back().first = v; // 同じタイルへの連続した変更はまとめる
+		return;
+	}
+	if (changes_.size() >= MAX_CHANGE_LOG) {
+		const size_t n = changes_.size() / 2;
+		log_floor_ = changes_[n - 1].first;
+		changes_.erase(changes_.begin(), changes_.begin() + n);
+	}
+	changes_.emplace_back(v, key);
+}
+
+void Document::Layer::markAll()
+{
+	full_version_ = newVersion();
+	log_floor_ = full_version_;
+	tile_versions_.clear();
+	changes_.clear();
+}
+
+uint64_t Document::Layer::tileVersion(int x, int y) const
+{
+	auto it = tile_versions_.find(tileKey(x, y));
+	if (it == tile_versions_.end()) return full_version_;
+	return std::max(it->second, full_version_);
+}
+
+// since より後に変更されたタイルを列挙する。記録が残っていないときは false
+bool Document::Layer::changedTiles(uint64_t since, std::vector<uint64_t> *out) const
+{
+	out->clear();
+	if (since < log_floor_) return false;
+	auto it = std::upper_bound(changes_.begin(), changes_.end(), since, [](uint64_t v, std::pair<uint64_t, uint64_t> const &c){
+		return v < c.first;
+	});
+	for (; it != changes_.end(); ++it) {
+		out->push_back(it->second);
+	}
+	return true;
+}
+
+void Document::Layer::journalReplace()
+{
+	LayerJournal *j = journal_;
+	if (!j || j->replaced) return;
+	j->snapshot = *this;
+	j->snapshot.journal_ = nullptr;
+	for (auto const &pair : j->tiles) {
+		j->snapshot.setPanel(tilePos(pair.first), pair.second);
+	}
+	j->tiles.clear();
+	j->replaced = true;
 }
 
 QRect Document::Layer::rect() const
 {
 	QRect rect;
+	for (PanelPtr const &panel : panels_) {
+		Block const *b = panel.block();
+		if (!b) continue;
+		if (b->isTransparent() || (b->isGrayscale8() && b->value_[0] == 0)) continue;
+		QRect r = QRect(b->offset(), b->size_).translated(offset());
+		if (rect.isNull()) {
+			rect = r;
+		} else {
+			rect = rect.united(r);
+		}
+	}
 	const_cast<Layer *>(this)->eachPanel([&](Image *p){
 		if (p->image_.format() == QImage::Format_Grayscale8) {
 			int w = p->image_.width();
@@ -522,6 +2086,7 @@ void Document::changeSelection(SelectionOperation op, const QRect &rect, QMutex
 
 	RenderOption opt;
 
+	beginUndoStep();
 	switch (op) {
 	case SelectionOperation::SetSelection:
 		clearSelection(sync);
@@ -534,5 +2099,6 @@ void Document::changeSelection(SelectionOperation op, const QRect &rect, QMutex
 		subSelection(layer, opt, sync, nullptr);
 		break;
 	}
+	endUndoStep(sync);
 }
 
@@ -1,24 +1,50 @@
 #ifndef DOCUMENT_H
 #define DOCUMENT_H
 
+#include "AlphaBlend.h"
+#include "TileAllocator.h"
+#include "TileStore.h"
 #include <QImage>
 #include <QPoint>
 #include <memory>
 #include <functional>
 #include <QMutex>
 #include <QColor>
+#include <QRegion>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
 
 class Document {
 public:
+	struct LayerJournal;
+	struct UndoStep;
+	struct MipPyramid;
+	struct LayerSnapshot;
+	struct Mask;
+
 	enum class Type {
 		Image,
 		Block,
 	};
 	struct Header {
-		unsigned int ref_ = 0;
+		std::atomic<unsigned int> ref_{0}; // 描画スレッドと共有するので不可分に増減する
 		Type type_ = Type::Image;
 		QPoint offset_;
 
+		Header() = default;
+		Header(Header const &r)
+			: type_(r.type_)
+			, offset_(r.offset_)
+		{
+		}
+		Header &operator = (Header const &r)
+		{
+			type_ = r.type_;
+			offset_ = r.offset_;
+			return *this;
+		}
+
 		QPoint offset() const
 		{
 			return offset_;
@@ -28,6 +54,7 @@ public:
 	struct Image {
 		Header header_;
 		QImage image_;
+		mutable TileStore::Node swap_;
 
 		QPoint offset() const
 		{
@@ -44,14 +71,19 @@ public:
 			setOffset(QPoint(x, y));
 		}
 
+		QSize size() const
+		{
+			return TileStore::size(&swap_, image_);
+		}
+
 		int width() const
 		{
-			return image_.width();
+			return size().width();
 		}
 
 		int height() const
 		{
-			return image_.height();
+			return size().height();
 		}
 
 		bool isRGBA8888() const
@@ -63,15 +95,58 @@ public:
 		{
 			return image_.format() == QImage::Format_Grayscale8;
 		}
+
+		// 画素を読み書きする前に呼ぶ
+		void touch() const
+		{
+			TileStore::touch(&swap_);
+		}
 	};
-//	struct Block {
-//		Header header_;
+	// 全画素が同じ値のタイル。書き込むときに Image に展開する
+	struct Block {
+		Header header_;
+		QImage::Format format_ = QImage::Format_RGBA8888;
+		QSize size_ = QSize(64, 64);
+		uint8_t value_[4] = {}; // RGBA8888 の画素値（Grayscale8 のときは value_[0] のみ）
+
+		QPoint offset() const
+		{
+			return header_.offset();
+		}
+
+		void setOffset(QPoint const &pt)
+		{
+			header_.offset_ = pt;
+		}
+
+		int width() const
+		{
+			return size_.width();
+		}
+
+		int height() const
+		{
+			return size_.height();
+		}
+
+		bool isRGBA8888() const
+		{
+			return format_ == QImage::Format_RGBA8888;
+		}
+
+		bool isGrayscale8() const
+		{
+			return format_ == QImage::Format_Grayscale8;
+		}
 
-//		QPoint offset() const
-//		{
-//			return header_.offset();
-//		}
-//	};
+		bool isTransparent() const
+		{
+			return isRGBA8888() && value_[3] == 0;
+		}
+	};
+	// パネルはプールの単位で割り当てる。収まらないと全てのパネルが malloc に回ってしまう
+	static_assert(sizeof(Image) <= TileAllocator::PANEL_SIZE, "Document::Image does not fit in TileAllocator::PANEL_SIZE");
+	static_assert(sizeof(Block) <= TileAllocator::PANEL_SIZE, "Document::Block does not fit in TileAllocator::PANEL_SIZE");
 
 	class PanelPtr {
 	private:
@@ -102,21 +177,20 @@ public:
 				return;
 			}
 			if (p) {
-				p->ref_++;
+				p->ref_.fetch_add(1, std::memory_order_relaxed);
 			}
 			if (object_) {
-				if (object_->ref_ > 1) {
-					object_->ref_--;
-				} else {
+				if (object_->ref_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
 					switch (object_->type_) {
 					case Type::Image:
 						reinterpret_cast<Image *>(object_)->~Image();
+						TileAllocator::freePanel(object_, sizeof(Image));
+						break;
+					case Type::Block:
+						reinterpret_cast<Block *>(object_)->~Block();
+						TileAllocator::freePanel(object_, sizeof(Block));
 						break;
-//					case Type::Block:
-//						reinterpret_cast<Block *>(object_)->~Block();
-//						break;
 					}
-					free(reinterpret_cast<void *>(object_));
 				}
 			}
 			object_ = p;
@@ -153,84 +227,132 @@ public:
 			return image();
 		}
 
-//		Block *block()
-//		{
-//			if (object_ && reinterpret_cast<Header *>(object_)->type_ == Type::Block) {
-//				return reinterpret_cast<Block *>(object_);
-//			}
-//			return nullptr;
-//		}
-//		Block const *block() const
-//		{
-//			if (object_ && reinterpret_cast<Header *>(object_)->type_ == Type::Block) {
-//				return reinterpret_cast<Block *>(object_);
-//			}
-//			return nullptr;
-//		}
-//		Block *operator -> ()
-//		{
-//			return block();
-//		}
-//		Block const *operator -> () const
-//		{
-//			return block();
-//		}
-//		operator Block *()
-//		{
-//			return block();
-//		}
-//		operator const Block *() const
-//		{
-//			return block();
-//		}
+		Block *block()
+		{
+			if (object_ && reinterpret_cast<Header *>(object_)->type_ == Type::Block) {
+				return reinterpret_cast<Block *>(object_);
+			}
+			return nullptr;
+		}
+		Block const *block() const
+		{
+			if (object_ && reinterpret_cast<Header *>(object_)->type_ == Type::Block) {
+				return reinterpret_cast<Block *>(object_);
+			}
+			return nullptr;
+		}
 
 		bool isImage() const
 		{
 			return image();
 		}
-//		bool isBlock() const
-//		{
-//			return block();
-//		}
+		bool isBlock() const
+		{
+			return block();
+		}
+		QPoint offset() const
+		{
+			return object_ ? object_->offset() : QPoint();
+		}
+		QSize size() const
+		{
+			if (Image const *p = image()) return p->size();
+			if (Block const *p = block()) return p->size_;
+			return QSize();
+		}
 		static PanelPtr makeImage()
 		{
-			void *o = malloc(sizeof(Image));
-			if (!o) throw std::bad_alloc();
+			void *o = TileAllocator::allocatePanel(sizeof(Image));
 			new(o) Image();
 			PanelPtr ptr;
 			ptr.assign(reinterpret_cast<Header *>(o));
 			return ptr;
 		}
+		static PanelPtr makeBlock()
+		{
+			void *o = TileAllocator::allocatePanel(sizeof(Block));
+			new(o) Block();
+			Block *p = reinterpret_cast<Block *>(o);
+			p->header_.type_ = Type::Block;
+			PanelPtr ptr;
+			ptr.assign(&p->header_);
+			return ptr;
+		}
 		operator bool ()
 		{
 			return object_;
 		}
+		unsigned int useCount() const
+		{
+			return object_ ? object_->ref_.load(std::memory_order_acquire) : 0;
+		}
 		PanelPtr copy() const
 		{
 			if (!object_) return {};
-			void *o = malloc(sizeof(Image));
-			if (!o) throw std::bad_alloc();
+			if (Block const *b = block()) {
+				PanelPtr ptr = makeBlock();
+				Block *p = ptr.block();
+				p->header_.offset_ = b->header_.offset_;
+				p->format_ = b->format_;
+				p->size_ = b->size_;
+				memcpy(p->value_, b->value_, sizeof(p->value_));
+				return ptr;
+			}
+			void *o = TileAllocator::allocatePanel(sizeof(Image));
 			new(o) Image(*reinterpret_cast<Image const *>(object_));
 			Image *p = reinterpret_cast<Image *>(o);
-			p->header_.ref_ = 0;
 			PanelPtr ptr;
 			ptr.assign(&p->header_);
 			return ptr;
 		}
+		PanelPtr expand() const;
 	};
 
+	using BlendMode = AlphaBlend::BlendMode;
+
 	class Layer {
 	public:
 		QPoint offset_;
 		bool tile_mode_ = false;
+		bool visible_ = true;
+		int opacity_ = 255;
+		BlendMode blend_mode_ = BlendMode::Normal;
 		std::vector<PanelPtr> panels_;
+		std::unordered_map<uint64_t, size_t> tile_index_; // タイル座標 -> panels_ のインデックス（タイルモードのみ）
+		LayerJournal *journal_ = nullptr; // アンドゥ記録中のみ有効
+
+		// 変更の追跡。バージョンは Layer::newVersion() が発行する全体で単調増加の番号
+		uint64_t full_version_ = 0; // レイヤー全体が変更されたバージョン
+		uint64_t log_floor_ = 0; // これより古い変更は changes_ から捨てた
+		std::unordered_map<uint64_t, uint64_t> tile_versions_; // タイル座標 -> 最後に変更されたバージョン
+		std::vector<std::pair<uint64_t, uint64_t>> changes_; // (バージョン, タイル座標) をバージョン順に記録
+
+		static uint64_t newVersion();
+		static uint64_t currentVersion();
+		void markTile(int x, int y);
+		void markAll();
+		uint64_t tileVersion(int x, int y) const;
+		bool changedTiles(uint64_t since, std::vector<uint64_t> *out) const;
+
+		static uint64_t tileKey(int x, int y)
+		{
+			return ((uint64_t)(uint32_t)(y >> 6) << 32) | (uint32_t)(x >> 6);
+		}
+
+		static QPoint tilePos(uint64_t key)
+		{
+			return QPoint((int32_t)(uint32_t)key * 64, (int32_t)(uint32_t)(key >> 32) * 64);
+		}
 
 		void clear(QMutex *sync)
 		{
 			if (sync) sync->lock();
 
+			journalReplace();
 			offset_ = QPoint();
 			panels_.clear();
+			tile_index_.clear();
+			markAll();
 
 			if (sync) sync->unlock();
 		}
@@ -240,23 +362,28 @@ public:
 			auto panel = PanelPtr::makeImage();
 			panel->setOffset(x, y);
 			if (w > 0 && h > 0) {
-				panel->image_ = QImage(w, h, QImage::Format_RGBA8888);
+				panel->image_ = TileAllocator::newTileImage(w, h, QImage::Format_RGBA8888);
 				panel->image_.fill(Qt::transparent);
 			}
+			if (tile_mode_) {
+				Q_ASSERT((x & 63) == 0 && (y & 63) == 0);
+				tile_index_[tileKey(x, y)] = panels_.size();
+				TileStore::track(&panel->swap_, &panel->image_);
+				markTile(x, y);
+			} else {
+				markAll();
+			}
 			panels_.push_back(panel);
-			std::sort(panels_.begin(), panels_.end(), [](PanelPtr const &l, PanelPtr const &r){
-				auto COMP = [](PanelPtr const &l, PanelPtr const &r){
-					if (l->offset().y() < r->offset().y()) return -1;
-					if (l->offset().y() > r->offset().y()) return 1;
-					if (l->offset().x() < r->offset().x()) return -1;
-					if (l->offset().x() > r->offset().x()) return 1;
-					return 0;
-				};
-				return COMP(l, r) < 0;
-			});
 			return panel;
 		}
 
+		PanelPtr *findPanel(int x, int y);
+		void findPanels(QRect const &r, std::vector<PanelPtr const *> *out) const;
+		PanelPtr writablePanel(int x, int y);
+		void setPanel(QPoint const &pos, PanelPtr const &panel);
+		bool compactPanel(int x, int y);
+		void journalReplace();
+
 		Layer() = default;
 
 		QPoint const &offset() const
@@ -266,18 +393,25 @@ public:
 
 		void setOffset(QPoint const &o)
 		{
+			if (offset_ == o) return;
 			offset_ = o;
+			markAll();
 		}
 
 		void eachPanel(std::function<void(Image *)> const &fn)
 		{
 			for (PanelPtr &ptr : panels_) {
-				fn(ptr.image());
+				if (Image *p = ptr.image()) {
+					p->touch();
+					fn(p);
+				}
 			}
 		}
 
+		// 1枚の画像を持つレイヤーにする。タイルモードのレイヤーは索引や追い出しの追跡が合わなくなるので使えない
 		void setImage(QPoint const &offset, QImage const &image)
 		{
+			Q_ASSERT(!tile_mode_);
 			clear(nullptr);
 			offset_ = offset;
 			addImagePanel();
@@ -290,10 +424,12 @@ public:
 	struct RenderOption {
 		enum Mode {
 			Default,
-			DirectCopy,
+			DirectCopy, // 合成せず写す。不透明度は使わず、選択範囲のマスクは画素ごとに適用する
 		};
 		Mode mode = Default;
 		QColor brush_color;
+		AlphaBlend::GammaMethod gamma = AlphaBlend::GammaMethod::Auto;
+		BlendMode blend_mode = BlendMode::Normal; // RGBA8888 のレイヤーに描くときだけ使う
 	};
 
 	struct Private;
@@ -311,28 +447,72 @@ public:
 	Layer *current_layer() const;
 	Layer *selection_layer() const;
 
-	void paintToCurrentLayer(const Layer &source, const RenderOption &opt, QMutex *sync, bool *abort);
-
-	QImage renderToLayer(QRect const &r, bool quickmask, QMutex *sync, bool *abort) const;
+	int layerCount() const;
+	Layer *layer(int index) const;
+	int currentLayerIndex() const;
+	void setCurrentLayerIndex(int index);
+	Layer *insertLayer(int index, QMutex *sync);
+	void removeLayer(int index, QMutex *sync);
+	void moveLayer(int from, int to, QMutex *sync);
+	void setLayerVisible(int index, bool visible, QMutex *sync);
+	void setLayerOpacity(int index, int opacity, QMutex *sync);
+	void setLayerBlendMode(int index, BlendMode mode, QMutex *sync);
+
+	// 合成を固定小数点（AlphaBlend::fixed_t）で行う。整数演算だけなので、どの環境でも同じ結果になる
+	void setFixedPoint(bool fixed, QMutex *sync);
+	bool isFixedPoint() const;
+
+	uint64_t version() const;
+	QRegion changedRegion(uint64_t since) const;
+	bool changedRegion(uint64_t since, QRegion *out) const;
+
+	void paintToCurrentLayer(const Layer &source, const RenderOption &opt, QMutex *sync, std::atomic_bool *abort);
+
+	// format は Format_RGBA8888 か Format_RGBA8888_Premultiplied（表示用）
+	QImage renderToLayer(QRect const &r, bool quickmask, QMutex *sync, std::atomic_bool *abort, QImage::Format format = QImage::Format_RGBA8888) const;
+	QImage renderReduced(QRect const &r, int level, QMutex *sync, std::atomic_bool *abort, QImage::Format format = QImage::Format_RGBA8888) const;
 private:
-	static void renderToEachPanels_(Image *target_panel, const QPoint &target_offset, const Layer &input_layer, Layer *mask_layer, const QColor &brush_color, int opacity, bool *abort);
-	static void renderToEachPanels(Image *target_panel, const QPoint &target_offset, const Layer &input_layer, Layer *mask_layer, const QColor &brush_color, int opacity, QMutex *sync, bool *abort);
+	std::shared_ptr<MipPyramid> mipmap(Layer const *layer) const;
+	void trimMipmaps(int keep_level) const;
+	void retireLayer(Layer const *layer);
+	void recordLayerStack();
+	void swapUndoStep(UndoStep *step, QMutex *sync);
+	static void takeSnapshot(Layer const &layer, QRect const &r, LayerSnapshot *out);
+	Layer const *singleLayer() const;
+	void syncComposite() const;
+	QImage compositeTile(int x, int y, bool premultiplied, QMutex *sync, std::atomic_bool *abort) const;
+	static void compositeSnapshots(std::vector<LayerSnapshot> const &layers, int x, int y, bool fixed, QImage *tile, std::atomic_bool *abort);
+	static Mask renderMask(QRect const &r, const QPoint &target_offset, const Layer *mask_layer, std::atomic_bool *abort);
+	static void renderToEachPanels_(Image *target_panel, const QPoint &target_offset, const Layer &input_layer, Layer *mask_layer, const QColor &brush_color, int opacity, std::atomic_bool *abort);
+	static void renderToEachPanels(Image *target_panel, const QPoint &target_offset, const Layer &input_layer, Layer *mask_layer, const QColor &brush_color, int opacity, QMutex *sync, std::atomic_bool *abort);
 public:
 	enum class SelectionOperation {
 		SetSelection,
 		AddSelection,
 		SubSelection,
 	};
-	static void renderToSinglePanel(Image *target_panel, const QPoint &target_offset, const Image *input_panel, const QPoint &input_offset, const Layer *mask_layer, RenderOption const &opt, const QColor &brush_color, int opacity = 255, bool *abort = nullptr);
-	static void renderToLayer(Layer *target_layer, const Layer &input_layer, Layer *mask_layer, const RenderOption &opt, QMutex *sync, bool *abort);
+	static void renderToSinglePanel(Image *target_panel, const QPoint &target_offset, const Image *input_panel, const QPoint &input_offset, const Layer *mask_layer, RenderOption const &opt, const QColor &brush_color, int opacity = 255, std::atomic_bool *abort = nullptr);
+	static void renderToSinglePanel(Image *target_panel, const QPoint &target_offset, const Block *input_panel, const QPoint &input_offset, const Layer *mask_layer, RenderOption const &opt, const QColor &brush_color, int opacity = 255, std::atomic_bool *abort = nullptr);
+	static void renderToLayer(Layer *target_layer, const Layer &input_layer, Layer *mask_layer, const RenderOption &opt, QMutex *sync, std::atomic_bool *abort);
 	void clearSelection(QMutex *sync);
-	void addSelection(const Layer &source, const RenderOption &opt, QMutex *sync, bool *abort);
-	void subSelection(const Layer &source, const RenderOption &opt, QMutex *sync, bool *abort);
-	QImage renderSelection(const QRect &r, QMutex *sync, bool *abort) const;
+	void addSelection(const Layer &source, const RenderOption &opt, QMutex *sync, std::atomic_bool *abort);
+	void subSelection(const Layer &source, const RenderOption &opt, QMutex *sync, std::atomic_bool *abort);
+	QImage renderSelection(const QRect &r, QMutex *sync, std::atomic_bool *abort) const;
+	QImage renderLayer(int index, QRect const &r, QMutex *sync, std::atomic_bool *abort) const;
+	void setLayerImage(int index, QImage const &image, QMutex *sync);
 	void changeSelection(SelectionOperation op, QRect const &rect, QMutex *sync);
-	QImage crop(const QRect &r, QMutex *sync, bool *abort) const;
+	QImage crop(const QRect &r, QMutex *sync, std::atomic_bool *abort) const;
 	void crop2(const QRect &r);
 	void clear(QMutex *sync);
+	void trimTiles(QMutex *sync);
+
+	void beginUndoStep();
+	void endUndoStep(QMutex *sync);
+	bool canUndo() const;
+	bool canRedo() const;
+	bool undo(QMutex *sync);
+	bool redo(QMutex *sync);
+	void clearUndoHistory();
 };
 
 #endif // DOCUMENT_H
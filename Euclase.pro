@@ -26,8 +26,11 @@ SOURCES += main.cpp\
 	RingSlider.cpp \
     SaturationBrightnessWidget.cpp \
 	SelectionOutlineRenderer.cpp \
+	TileAllocator.cpp \
+	TileStore.cpp \
 	TransparentCheckerBrush.cpp \
 	antialias.cpp \
+	cpu.cpp \
 	euclase.cpp \
 	median.cpp \
     misc.cpp \
@@ -48,13 +51,17 @@ HEADERS  += MainWindow.h \
     ColorPreviewWidget.h \
     Document.h \
     ImageViewRenderer.h \
+    RenderQueue.h \
     MiraCL.h \
     MyWidget.h \
     NewDialog.h \
     RingSlider.h \
     SelectionOutlineRenderer.h \
+    TileAllocator.h \
+    TileStore.h \
     TransparentCheckerBrush.h \
     antialias.h \
+    cpu.h \
     euclase.h \
     main.h \
     MyApplication.h \
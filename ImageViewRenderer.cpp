@@ -1,7 +1,17 @@
 #include "ImageViewRenderer.h"
 #include "MainWindow.h"
 #include "TransparentCheckerBrush.h"
+#include "euclase.h"
 #include <QPainter>
+#include <QSemaphore>
+#include <QThreadPool>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <vector>
+
+const int PROGRESSIVE_COARSE = 2; // 仮の画像は本来より 2 段階小さい縮小画像から描く
+const int RENDER_TILE = 256; // この大きさ（表示座標）のタイルに分けて並列に描き、できたものから届ける
 
 
 ImageViewRenderer::ImageViewRenderer(QObject *parent)
@@ -11,39 +21,244 @@ ImageViewRenderer::ImageViewRenderer(QObject *parent)
 
 ImageViewRenderer::~ImageViewRenderer()
 {
-	abort(true);
+	queue_.quit();
+	wait();
+}
+
+// 縮小表示のときは表示倍率を下回らない範囲で小さい縮小画像から描く
+int ImageViewRenderer::reductionLevel(double scale)
+{
+	int level = 0;
+	while (level < 8 && scale * (2 << level) <= 1.0) {
+		level++;
+	}
+	return level;
+}
+
+// 表示座標の範囲 rect を描くのに使うドキュメントの範囲
+// 表示座標の画素 X はドキュメントの画素 floor((X + 0.5) / scale) を表す
+QRect ImageViewRenderer::documentRect(QRect const &rect, double scale)
+{
+	const int x0 = (int)floor((rect.left() + 0.5) / scale);
+	const int y0 = (int)floor((rect.top() + 0.5) / scale);
+	const int x1 = (int)floor((rect.right() + 0.5) / scale) + 1;
+	const int y1 = (int)floor((rect.bottom() + 0.5) / scale) + 1;
+	return QRect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// ドキュメントの範囲 document_rect が表示される表示座標の範囲（端の画素を含む）
+QRect ImageViewRenderer::viewRect(QRect const &document_rect, double scale)
+{
+	const int x0 = (int)floor(document_rect.left() * scale) - 1;
+	const int y0 = (int)floor(document_rect.top() * scale) - 1;
+	const int x1 = (int)ceil((document_rect.right() + 1) * scale) + 1;
+	const int y1 = (int)ceil((document_rect.bottom() + 1) * scale) + 1;
+	return QRect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// 表示座標の範囲 rect を、表示倍率 scale で描いた画像
+// 最近傍で拡大縮小し、チェッカーボードと合成する。画面への描画は転送だけで済む
+// coarse を指定すると、その段階だけ小さい縮小画像から描く（粗いが速い）
+QImage ImageViewRenderer::renderView(MainWindow *mw, QRect const &rect, double scale, std::atomic_bool *abort, int coarse)
+{
+	if (rect.isEmpty()) return {};
+	const int level = std::min(reductionLevel(scale) + coarse, 8);
+	const int align = (1 << level) - 1;
+	QRect src = documentRect(rect, scale);
+	src.setLeft(src.left() & ~align);
+	src.setTop(src.top() & ~align);
+
+	// 表示用は乗算済みアルファで受け取る
+	QImage source;
+	if (level > 0) {
+		source = mw->renderReducedImage(src, level, abort, QImage::Format_RGBA8888_Premultiplied);
+	} else {
+		source = mw->renderImage(src, false, abort, QImage::Format_RGBA8888_Premultiplied);
+	}
+	if ((abort && *abort) || source.isNull()) return {};
+
+	// 列ごとの参照位置（縮小画像の画素）
+	const int w = rect.width();
+	const int h = rect.height();
+	std::vector<int> xs(w);
+	for (int i = 0; i < w; i++) {
+		int x = ((int)floor((rect.x() + i + 0.5) / scale) >> level) - (src.x() >> level);
+		xs[i] = std::max(0, std::min(x, source.width() - 1));
+	}
+
+	QImage image(w, h, QImage::Format_RGB32);
+	for (int i = 0; i < h; i++) {
+		if (abort && *abort) return {};
+		const int Y = rect.y() + i;
+		int y = ((int)floor((Y + 0.5) / scale) >> level) - (src.y() >> level);
+		y = std::max(0, std::min(y, source.height() - 1));
+		euclase::PixelRGBA const *s = reinterpret_cast<euclase::PixelRGBA const *>(source.constScanLine(y));
+		QRgb *d = reinterpret_cast<QRgb *>(image.scanLine(i));
+		for (int j = 0; j < w; j++) {
+			const int X = rect.x() + j;
+			euclase::PixelRGBA const &p = s[xs[j]];
+			const int k = (TransparentCheckerBrush::shade(X, Y) * (255 - p.a) + 127) / 255; // 乗算済みなので足すだけ
+			d[j] = qRgb(p.r + k, p.g + k, p.b + k);
+		}
+	}
+	return image;
+}
+
+// 範囲 rects を、表示座標で RENDER_TILE ごとの格子に揃えたタイルに分け、focus に近い順に並べる
+// 点とタイルの距離（中にあれば 0）で比べ、同じならタイルの中心までの距離で比べる
+std::vector<QRect> ImageViewRenderer::tilesByPriority(std::vector<QRect> const &rects, QPoint const &focus)
+{
+	struct Item {
+		QRect rect;
+		int64_t edge;
+		int64_t center;
+	};
+	std::vector<Item> items;
+	for (QRect const &rect : rects) {
+		for (int y = rect.top() & ~(RENDER_TILE - 1); y <= rect.bottom(); y += RENDER_TILE) {
+			for (int x = rect.left() & ~(RENDER_TILE - 1); x <= rect.right(); x += RENDER_TILE) {
+				Item item;
+				item.rect = QRect(x, y, RENDER_TILE, RENDER_TILE).intersected(rect);
+				if (item.rect.isEmpty()) continue;
+				const int64_t dx = std::max({item.rect.left() - focus.x(), focus.x() - item.rect.right(), 0});
+				const int64_t dy = std::max({item.rect.top() - focus.y(), focus.y() - item.rect.bottom(), 0});
+				const int64_t cx = 2 * focus.x() - (item.rect.left() + item.rect.right());
+				const int64_t cy = 2 * focus.y() - (item.rect.top() + item.rect.bottom());
+				item.edge = dx * dx + dy * dy;
+				item.center = cx * cx + cy * cy;
+				items.push_back(item);
+			}
+		}
+	}
+	std::stable_sort(items.begin(), items.end(), [](Item const &a, Item const &b){
+		if (a.edge != b.edge) return a.edge < b.edge;
+		return a.center < b.center;
+	});
+	std::vector<QRect> tiles;
+	tiles.reserve(items.size());
+	for (Item const &item : items) {
+		tiles.push_back(item.rect);
+	}
+	return tiles;
+}
+
+// 優先順に並んだタイルを、このスレッドとスレッドプールの空いているスレッドで先頭から取って描く
+// 描けたタイルはその場で届ける。新しい要求が来たら、描きかけのタイルで止める
+void ImageViewRenderer::renderTiles(Queue::Request const &req, std::vector<QRect> const &tiles)
+{
+	std::atomic<size_t> next(0);
+	std::function<void()> work = [&](){
+		size_t i;
+		while (!req.isCancelled() && !queue_.hasPending() && (i = next++) < tiles.size()) {
+			deliver(req, tiles[i], 0);
+		}
+	};
+
+	class Worker : public QRunnable {
+	public:
+		std::function<void()> const *work;
+		QSemaphore *done;
+		void run() override
+		{
+			(*work)();
+			done->release();
+		}
+	};
+
+	QSemaphore done;
+	QThreadPool *pool = QThreadPool::globalInstance();
+	const int helpers = (int)std::min<size_t>(pool->maxThreadCount(), tiles.size()) - 1;
+	int started = 0;
+	for (int i = 0; i < helpers; i++) {
+		Worker *w = new Worker;
+		w->work = &work;
+		w->done = &done;
+		if (!pool->tryStart(w)) {
+			delete w;
+			break;
+		}
+		started++;
+	}
+	work();
+	done.acquire(started);
 }
 
 void ImageViewRenderer::run()
 {
-	while (requested_) {
-		requested_ = false;
-		bool quickmask = false;
-		RenderedImage ri;
-		ri.rect = rect_;
-		ri.image = mainwindow_->renderImage(ri.rect, quickmask, &abort_);
-		if (!abort_) {
-			emit done(ri);
+	Queue::Request req;
+	while (queue_.take(&req)) {
+		Job const &job = req.data;
+		// 広い範囲は、まず粗い画像を全体に出しておく
+		if (progressive_ && reductionLevel(job.scale) + PROGRESSIVE_COARSE <= 8) {
+			for (QRect const &rect : job.rects) {
+				if (req.isCancelled() || queue_.hasPending()) break;
+				if (rect.width() > RENDER_TILE || rect.height() > RENDER_TILE) {
+					deliver(req, rect, PROGRESSIVE_COARSE);
+				}
+			}
+		}
+		// カーソル（または表示の中央）に近いタイルから仕上げる
+		renderTiles(req, tilesByPriority(job.rects, job.focus));
+		if (req.isCancelled()) {
+			queue_.finish(Queue::Outcome::Cancelled);
+		} else if (queue_.hasPending()) {
+			queue_.finish(Queue::Outcome::Coalesced); // 描きかけのまま新しい要求に譲った
+		} else {
+			queue_.finish(Queue::Outcome::Completed);
 		}
 	}
 }
 
-void ImageViewRenderer::request(MainWindow *mw, const QRect &rect)
+void ImageViewRenderer::deliver(Queue::Request const &req, QRect const &rect, int coarse)
 {
-	mainwindow_ = mw;
-	rect_ = rect;
-	requested_ = true;
-	abort_ = false;
+	RenderedImage ri;
+	ri.rect = rect;
+	ri.scale = req.data.scale;
+	ri.version = req.data.version;
+	ri.generation = req.generation;
+	ri.preview = coarse > 0;
+	ri.image = renderView(req.data.mainwindow, ri.rect, ri.scale, req.cancel.get(), coarse);
+	if (!req.isCancelled() && !ri.image.isNull()) {
+		emit done(ri);
+	}
+}
+
+// 描画を要求し、その世代番号を返す。まだ始まっていない要求は置き換える
+// focus は優先して描く位置（表示座標）
+uint64_t ImageViewRenderer::request(MainWindow *mw, std::vector<QRect> const &rects, double scale, uint64_t version, QPoint const &focus)
+{
+	Job job;
+	job.mainwindow = mw;
+	job.rects = rects;
+	job.focus = focus;
+	job.scale = scale;
+	job.version = version;
+	const uint64_t generation = queue_.post(job);
 	if (!isRunning()) {
 		start();
 	}
+	return generation;
+}
+
+// 広い範囲を粗い画像から段階的に描くか
+void ImageViewRenderer::setProgressive(bool progressive)
+{
+	progressive_ = progressive;
 }
 
+// まだ始まっていない要求を捨て、描画中の要求を中止する
 void ImageViewRenderer::abort(bool wait)
 {
-	abort_ = true;
-	if (wait) {
-		QThread::wait();
-	}
+	queue_.cancel(wait);
+}
+
+// 最後に要求した世代番号
+uint64_t ImageViewRenderer::generation() const
+{
+	return queue_.generation();
 }
 
+RenderQueueStats ImageViewRenderer::stats() const
+{
+	return queue_.stats();
+}
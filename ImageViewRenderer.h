@@ -1,36 +1,60 @@
 #ifndef IMAGEVIEWRENDERER_H
 #define IMAGEVIEWRENDERER_H
 
+#include "RenderQueue.h"
 #include <QBrush>
 #include <QImage>
 #include <QObject>
 #include <QRect>
 #include <QThread>
 #include <deque>
+#include <vector>
 
 class MainWindow;
 
+// 表示座標: ドキュメントの左上を原点とし、表示倍率を掛けた画素の座標。スクロールしても変わらない
 class RenderedImage {
 public:
-	QRect rect;
-	QImage image;
+	QRect rect; // 表示座標
+	double scale = 1; // 表示倍率
+	uint64_t version = 0; // 要求したときのドキュメントのバージョン
+	uint64_t generation = 0; // 要求の世代番号（ImageViewRenderer::request の戻り値）
+	bool preview = false; // 粗い縮小画像から描いた仮の画像。後から同じ範囲の本来の画像が届く
+	QImage image; // rect の大きさ（Format_RGB32）。透明な部分はチェッカーボードと合成済みで、そのまま画面に描ける
 };
 Q_DECLARE_METATYPE(RenderedImage)
 
 class ImageViewRenderer : public QThread {
 	Q_OBJECT
 private:
-	volatile bool requested_ = false;
-	MainWindow *mainwindow_;
-	QRect rect_;
-	bool abort_ = false;
+	struct Job {
+		MainWindow *mainwindow = nullptr;
+		std::vector<QRect> rects;
+		QPoint focus; // ここに近いタイルから描く（表示座標）
+		double scale = 1;
+		uint64_t version = 0;
+	};
+	using Queue = RenderQueue<Job>;
+	Queue queue_;
+	std::atomic_bool progressive_{true};
+	void deliver(Queue::Request const &req, QRect const &rect, int coarse);
+	void renderTiles(Queue::Request const &req, std::vector<QRect> const &tiles);
 protected:
 	void run();
 public:
 	explicit ImageViewRenderer(QObject *parent = nullptr);
 	~ImageViewRenderer();
-	void request(MainWindow *mw, QRect const &rect);
+	uint64_t request(MainWindow *mw, std::vector<QRect> const &rects, double scale, uint64_t version, QPoint const &focus);
 	void abort(bool wait);
+	void setProgressive(bool progressive);
+	uint64_t generation() const;
+	RenderQueueStats stats() const;
+
+	static int reductionLevel(double scale);
+	static QRect documentRect(QRect const &rect, double scale);
+	static QRect viewRect(QRect const &document_rect, double scale);
+	static std::vector<QRect> tilesByPriority(std::vector<QRect> const &rects, QPoint const &focus);
+	static QImage renderView(MainWindow *mw, QRect const &rect, double scale, std::atomic_bool *abort, int coarse = 0);
 signals:
 	void done(RenderedImage const &image);
 };
@@ -21,12 +21,29 @@
 #include <cmath>
 #include <functional>
 #include <memory>
-#include "TransparentCheckerBrush.h"
+#include <unordered_map>
 
 using SvgRendererPtr = std::shared_ptr<QSvgRenderer>;
 
 const int MAX_SCALE = 32;
 const int MIN_SCALE = 8;
+const size_t MAX_DISPLAY_TILES = 2048; // 64x64 RGB32 で 32MB
+const int PREFETCH_MARGIN = 512; // 表示範囲の周りを先読みする幅（表示座標）
+const int PREFETCH_TILE = 256; // 先読みはこの大きさのタイルごと（ImageViewRenderer の格子と同じ）
+const size_t PREFETCH_MAX_BYTES = 64 * 1024 * 1024; // 先読みした画像の合計の上限
+
+// 画面に描くための 64x64 のタイル（表示座標）
+struct DisplayTile {
+	QPixmap pixmap;
+	QRect rect; // pixmap が表す範囲。タイルと描画済みの範囲が重なる部分
+	double scale = 0;
+	uint64_t version = 0; // 元にした RenderedImage のドキュメントのバージョン
+};
+
+static uint64_t displayTileKey(int x, int y)
+{
+	return ((uint64_t)(uint32_t)(y >> 6) << 32) | (uint32_t)(x >> 6);
+}
 
 struct ImageViewWidget::Private {
 	MainWindow *mainwindow = nullptr;
@@ -52,9 +69,27 @@ struct ImageViewWidget::Private {
 
 	ImageViewRenderer *renderer = nullptr;
 	RenderedImage rendered_image;
+	QRect view_rect; // rendered_image が表すべき範囲（表示座標）
+	double view_scale = 1;
+	uint64_t view_version = 0; // view_rect を要求したときのドキュメントのバージョン
+	QRegion pending; // 描画を要求してまだ届いていない範囲（表示座標）
+	uint64_t render_floor = 0; // これより古い世代の描画結果は捨てる（stopRendering の前に要求したもの）
+
+	// 手が空いたときに表示範囲の周りを描いておき、スクロールで見えたところに使う
+	ImageViewRenderer *prefetcher = nullptr;
+	int prefetch_margin = PREFETCH_MARGIN; // 0 なら先読みしない
+	std::unordered_map<uint64_t, RenderedImage> prefetched; // 先読みした画像（左上の位置で引く）
+	size_t prefetched_bytes = 0;
+	uint64_t prefetch_floor = 0; // これより古い世代の先読みは捨てる
+	QRect prefetch_view; // 先読みを要求したときの view_rect
+	uint64_t prefetch_version = 0;
+	double pan_dx = 0; // 最近のスクロールの向き（表示座標）
+	double pan_dy = 0;
+	std::unordered_map<uint64_t, DisplayTile> display_tiles; // rendered_image から作った画面用のタイル
 	QRect destination_rect;
 
 	SelectionOutlineRenderer *outline_renderer = nullptr;
+	uint64_t outline_generation = 0; // 受け取る選択範囲の輪郭の世代番号
 
 	QPixmap transparent_pixmap;
 
@@ -78,6 +113,10 @@ ImageViewWidget::ImageViewWidget(QWidget *parent)
 	m->renderer = new ImageViewRenderer(this);
 	connect(m->renderer, &ImageViewRenderer::done, this, &ImageViewWidget::onRenderingCompleted);
 
+	m->prefetcher = new ImageViewRenderer(this);
+	m->prefetcher->setProgressive(false);
+	connect(m->prefetcher, &ImageViewRenderer::done, this, &ImageViewWidget::onPrefetchCompleted);
+
 	m->outline_renderer = new SelectionOutlineRenderer(this);
 	connect(m->outline_renderer, &SelectionOutlineRenderer::done, this, &ImageViewWidget::onSelectionOutlineRenderingCompleted);
 
@@ -118,8 +157,14 @@ void ImageViewWidget::bind(MainWindow *mainwindow, QScrollBar *vsb, QScrollBar *
 void ImageViewWidget::stopRendering(bool wait)
 {
 	m->renderer->abort(wait);
+	m->render_floor = m->renderer->generation() + 1; // 届いていない結果は使わない
+	m->prefetcher->abort(wait);
+	clearPrefetch();
 	m->rendered_image = {};
+	m->view_rect = {};
+	m->pending = {};
 	m->destination_rect = {};
+	m->display_tiles.clear();
 }
 
 QPointF ImageViewWidget::mapFromViewportToDocument(QPointF const &pos)
@@ -140,11 +185,30 @@ QPointF ImageViewWidget::mapFromDocumentToViewport(QPointF const &pos)
 	return QPointF(x, y);
 }
 
+// 表示座標の原点（ドキュメントの左上）のビューポート上の位置
+QPoint ImageViewWidget::viewOrigin()
+{
+	QPointF org = mapFromDocumentToViewport(QPointF(0, 0));
+	return QPoint((int)floor(org.x() + 0.5), (int)floor(org.y() + 0.5));
+}
+
 QMutex *ImageViewWidget::synchronizer()
 {
 	return &m->sync;
 }
 
+// 画像と選択範囲の輪郭の描画要求の集計
+RenderQueueStats ImageViewWidget::renderStats() const
+{
+	RenderQueueStats s = m->renderer->stats();
+	RenderQueueStats t = m->outline_renderer->stats();
+	s.issued += t.issued;
+	s.coalesced += t.coalesced;
+	s.cancelled += t.cancelled;
+	s.completed += t.completed;
+	return s;
+}
+
 void ImageViewWidget::showRect(QPointF const &start, QPointF const &end)
 {
 	m->rect_start = start;
@@ -192,6 +256,8 @@ QBrush ImageViewWidget::stripeBrush(bool blink)
 
 void ImageViewWidget::internalScrollImage(double x, double y, bool updateview)
 {
+	const double old_x = m->image_scroll_x;
+	const double old_y = m->image_scroll_y;
 	m->image_scroll_x = x;
 	m->image_scroll_y = y;
 	QSizeF sz = imageScrollRange();
@@ -200,6 +266,10 @@ void ImageViewWidget::internalScrollImage(double x, double y, bool updateview)
 	if (m->image_scroll_x > sz.width()) m->image_scroll_x = sz.width();
 	if (m->image_scroll_y > sz.height()) m->image_scroll_y = sz.height();
 
+	// 先読みを寄せる向き。古い動きほど効かなくする
+	m->pan_dx = m->pan_dx / 2 + (m->image_scroll_x - old_x);
+	m->pan_dy = m->pan_dy / 2 + (m->image_scroll_y - old_y);
+
 	if (updateview) {
 		paintViewLater(true, true);
 	}
@@ -277,18 +347,271 @@ void ImageViewWidget::setSelectionOutline(const SelectionOutlineBitmap &data)
 
 void ImageViewWidget::clearSelectionOutline()
 {
-	m->outline_renderer->abort();
+	m->outline_generation = 0;
+	m->outline_renderer->abort(false);
 	setSelectionOutline(SelectionOutlineBitmap());
 }
 
 void ImageViewWidget::onRenderingCompleted(RenderedImage const &image)
 {
-	m->rendered_image = image;
+	if (image.generation < m->render_floor) return;
+	if (image.scale != m->view_scale) return;
+	// 要求した後にドキュメントが変更されていたら仮の画像として扱う。
+	// 変更された範囲は描画待ちに入っているので、そこを埋めるだけで描画待ちからは外さない
+	const bool current = image.version == m->view_version;
+	RenderedImage &ri = m->rendered_image;
+	if (current && image.rect == m->view_rect) {
+		ri = image;
+	} else {
+		if (ri.image.isNull() || ri.scale != image.scale) {
+			// 拡大縮小の直後などで受け皿がなければ、表示範囲の大きさで用意して届いたところから埋める
+			ri.image = QImage(m->view_rect.size(), QImage::Format_RGB32);
+			ri.image.fill(QColor(240, 240, 240));
+			ri.rect = m->view_rect;
+			ri.scale = image.scale;
+			ri.version = image.version;
+			ri.generation = image.generation;
+			ri.preview = false;
+		} else if (ri.rect != m->view_rect) {
+			shiftRenderedImage(m->view_rect);
+		}
+		// 古い結果は、新しい結果が届いて描画待ちから外れたところには描かない
+		QRegion region(image.rect.intersected(ri.rect));
+		if (!current) region &= m->pending;
+		if (region.isEmpty()) return;
+		// 変更された部分や新しく見えた部分だけ差し替える
+		QPainter pr(&ri.image);
+		pr.setCompositionMode(QPainter::CompositionMode_Source);
+		pr.setClipRegion(region.translated(-ri.rect.topLeft()));
+		pr.drawImage(image.rect.topLeft() - ri.rect.topLeft(), image.image);
+	}
+	// 描き込んだ範囲だけ描画待ちから外す。仮の画像なら本来の画像が届くまで待つ
+	if (current && !image.preview) {
+		m->pending -= image.rect.intersected(ri.rect);
+	}
+	invalidateDisplayTiles(image.rect);
 	update();
+	document()->trimTiles(&m->sync);
+}
+
+// 表示座標で同じ倍率のまま範囲 r を表すように rendered_image をずらす
+// 重なる部分はそのまま使い、新しく見える部分は描画が届くまで背景色にしておく
+QRegion ImageViewWidget::shiftRenderedImage(QRect const &r)
+{
+	RenderedImage &ri = m->rendered_image;
+	QImage image(r.size(), QImage::Format_RGB32);
+	image.fill(QColor(240, 240, 240));
+	{
+		QPainter pr(&image);
+		pr.setCompositionMode(QPainter::CompositionMode_Source);
+		pr.drawImage(ri.rect.topLeft() - r.topLeft(), ri.image);
+	}
+	QRegion exposed = QRegion(r).subtracted(ri.rect);
+	ri.rect = r;
+	ri.image = image;
+	invalidateDisplayTiles(QRect());
+	return exposed;
+}
+
+// 画面用のタイルのうち、rendered_image の changed の範囲と重なるものや、
+// rendered_image の範囲がずれて覆う範囲が変わったものを捨てる
+void ImageViewWidget::invalidateDisplayTiles(QRect const &changed)
+{
+	auto &tiles = m->display_tiles;
+	RenderedImage const &ri = m->rendered_image;
+	for (auto it = tiles.begin(); it != tiles.end(); ) {
+		DisplayTile const &t = it->second;
+		const QRect tile(t.rect.x() & ~63, t.rect.y() & ~63, 64, 64);
+		const bool keep = t.scale == ri.scale && t.rect == tile.intersected(ri.rect) && !tile.intersects(changed);
+		if (keep) {
+			++it;
+		} else {
+			it = tiles.erase(it);
+		}
+	}
+}
+
+// 表示範囲の周りを先読みする幅（表示座標）。0 なら先読みしない
+void ImageViewWidget::setPrefetchMargin(int margin)
+{
+	m->prefetch_margin = std::max(margin, 0);
+	if (m->prefetch_margin == 0) {
+		clearPrefetch();
+	}
+}
+
+// 先読みを止めて、先読みした画像を捨てる
+void ImageViewWidget::clearPrefetch()
+{
+	m->prefetcher->abort(false);
+	m->prefetch_floor = m->prefetcher->generation() + 1;
+	m->prefetched.clear();
+	m->prefetched_bytes = 0;
+	m->prefetch_view = {};
+}
+
+// 描画待ちの画像がなければ、表示範囲の周りを先読みする
+// 最近スクロールした向きには広く、反対側には狭く取り、進む側の端に近いタイルから描く
+void ImageViewWidget::prefetchAroundView()
+{
+	if (m->prefetch_margin <= 0) return;
+	RenderedImage const &ri = m->rendered_image;
+	if (!m->pending.isEmpty() || ri.image.isNull() || ri.rect != m->view_rect || ri.scale != m->view_scale) return;
+	if (m->prefetch_view == m->view_rect && m->prefetch_version == m->view_version) return; // 要求済み
+	m->prefetch_view = m->view_rect;
+	m->prefetch_version = m->view_version;
+
+	const double scale = m->view_scale;
+	const QSize sz = imageSize();
+	const QRect view(0, 0, (int)floor(sz.width() * scale + 0.5), (int)floor(sz.height() * scale + 0.5));
+	const QRect &r = m->view_rect;
+	const double len = hypot(m->pan_dx, m->pan_dy);
+	const double bx = len > 0 ? m->pan_dx / len : 0;
+	const double by = len > 0 ? m->pan_dy / len : 0;
+	auto Margin = [&](double b){
+		return (int)(m->prefetch_margin * (1 + 0.75 * b)); // 進む側は 1.75 倍、戻る側は 0.25 倍まで
+	};
+	const QRect area = r.adjusted(-Margin(-bx), -Margin(-by), Margin(bx), Margin(by)).intersected(view);
+	evictPrefetched(area, PREFETCH_MAX_BYTES); // 新しい範囲から外れたものを先に捨てて、要求できる分を空ける
+
+	std::vector<QRect> cells;
+	for (int y = area.top() & ~(PREFETCH_TILE - 1); y <= area.bottom(); y += PREFETCH_TILE) {
+		for (int x = area.left() & ~(PREFETCH_TILE - 1); x <= area.right(); x += PREFETCH_TILE) {
+			const QRect cell = QRect(x, y, PREFETCH_TILE, PREFETCH_TILE).intersected(view);
+			if (cell.isEmpty() || r.contains(cell)) continue;
+			auto it = m->prefetched.find(displayTileKey(cell.x(), cell.y()));
+			if (it != m->prefetched.end() && it->second.rect == cell) continue;
+			cells.push_back(cell);
+		}
+	}
+	const QPoint focus = r.center() + QPoint((int)(bx * r.width() / 2), (int)(by * r.height() / 2));
+	cells = ImageViewRenderer::tilesByPriority(cells, focus);
+	// 上限に収まる分だけ
+	size_t bytes = m->prefetched_bytes;
+	size_t n = 0;
+	while (n < cells.size()) {
+		bytes += (size_t)cells[n].width() * cells[n].height() * 4;
+		if (bytes > PREFETCH_MAX_BYTES) break;
+		n++;
+	}
+	cells.resize(n);
+	if (cells.empty()) return;
+	m->prefetcher->request(mainwindow(), cells, scale, m->view_version, focus);
+}
+
+// target のうち先読みした画像があるところを rendered_image に描き、描いた範囲を返す
+QRegion ImageViewWidget::applyPrefetched(QRegion const &target)
+{
+	RenderedImage &ri = m->rendered_image;
+	QRegion filled;
+	if (ri.image.isNull()) return filled;
+	QPainter pr(&ri.image);
+	pr.setCompositionMode(QPainter::CompositionMode_Source);
+	pr.setClipRegion(target.translated(-ri.rect.topLeft()));
+	const QRegion rest = m->pending.subtracted(target);
+	for (auto it = m->prefetched.begin(); it != m->prefetched.end(); ) {
+		RenderedImage const &p = it->second;
+		if (p.scale != ri.scale || !target.intersects(p.rect)) {
+			++it;
+			continue;
+		}
+		pr.drawImage(p.rect.topLeft() - ri.rect.topLeft(), p.image);
+		filled += p.rect;
+		// 表示範囲に収まり、ほかに描画待ちの部分もなければ要らなくなる
+		// 表示範囲からはみ出しているものは、スクロールで使うかもしれないので残す
+		if (ri.rect.contains(p.rect) && !rest.intersects(p.rect)) {
+			m->prefetched_bytes -= p.image.bytesPerLine() * p.image.height();
+			it = m->prefetched.erase(it);
+		} else {
+			++it;
+		}
+	}
+	filled &= target;
+	filled &= ri.rect;
+	if (!filled.isEmpty()) {
+		invalidateDisplayTiles(filled.boundingRect());
+	}
+	return filled;
+}
+
+// 先読みした画像のうち area（空なら全体）から外れたものを捨て、
+// 合計が limit を超えていれば表示範囲の中心から遠いものから捨てる
+void ImageViewWidget::evictPrefetched(QRect const &area, size_t limit)
+{
+	auto &tiles = m->prefetched;
+	auto erase = [&](std::unordered_map<uint64_t, RenderedImage>::iterator it){
+		m->prefetched_bytes -= it->second.image.bytesPerLine() * it->second.image.height();
+		return tiles.erase(it);
+	};
+	if (!area.isEmpty()) {
+		for (auto it = tiles.begin(); it != tiles.end(); ) {
+			if (area.intersects(it->second.rect)) {
+				++it;
+			} else {
+				it = erase(it);
+			}
+		}
+	}
+	const QPoint c = m->view_rect.center();
+	while (m->prefetched_bytes > limit && !tiles.empty()) {
+		auto farthest = tiles.begin();
+		int64_t farthest_d = -1;
+		for (auto i = tiles.begin(); i != tiles.end(); ++i) {
+			const QPoint p = i->second.rect.center() - c;
+			const int64_t d = (int64_t)p.x() * p.x() + (int64_t)p.y() * p.y();
+			if (d > farthest_d) {
+				farthest = i;
+				farthest_d = d;
+			}
+		}
+		erase(farthest);
+	}
+}
+
+void ImageViewWidget::onPrefetchCompleted(RenderedImage const &image)
+{
+	if (image.generation < m->prefetch_floor) return;
+	if (image.scale != m->view_scale || image.version != m->view_version) return;
+	const uint64_t key = displayTileKey(image.rect.x(), image.rect.y());
+	auto it = m->prefetched.find(key);
+	if (it != m->prefetched.end()) {
+		m->prefetched_bytes -= it->second.image.bytesPerLine() * it->second.image.height();
+	}
+	m->prefetched[key] = image;
+	m->prefetched_bytes += image.image.bytesPerLine() * image.image.height();
+
+	evictPrefetched(QRect(), PREFETCH_MAX_BYTES);
+
+	// 届く前にスクロールして見えていたら、すぐに使う
+	if (m->pending.intersects(image.rect) && m->rendered_image.rect == m->view_rect) {
+		m->pending -= applyPrefetched(m->pending.intersected(image.rect));
+		update();
+	}
+}
+
+// rect（表示座標で 64 に揃えたタイル）を描くための QPixmap
+QPixmap const *ImageViewWidget::displayTile(QRect const &tile)
+{
+	RenderedImage const &ri = m->rendered_image;
+	const QRect r = tile.intersected(ri.rect);
+	if (r.isEmpty()) return nullptr;
+	const uint64_t key = displayTileKey(tile.x(), tile.y());
+	auto it = m->display_tiles.find(key);
+	if (it != m->display_tiles.end()) return &it->second.pixmap;
+	if (m->display_tiles.size() >= MAX_DISPLAY_TILES) {
+		m->display_tiles.clear();
+	}
+	DisplayTile &t = m->display_tiles[key];
+	t.pixmap = QPixmap::fromImage(ri.image.copy(r.translated(-ri.rect.topLeft())));
+	t.rect = r;
+	t.scale = ri.scale;
+	t.version = ri.version;
+	return &t.pixmap;
 }
 
 void ImageViewWidget::onSelectionOutlineRenderingCompleted(SelectionOutlineBitmap const &data)
 {
+	if (data.generation != m->outline_generation) return; // 取り消した、または新しい要求がある
 	setSelectionOutline(data);
 	update();
 }
@@ -310,23 +633,58 @@ void ImageViewWidget::paintViewLater(bool image, bool selection_outline)
 	QSize imagesize = imageSize();
 
 	if (image) {
-		QPointF pt0 = mapFromViewportToDocument(QPointF(0, 0));
-		QPointF pt1 = mapFromViewportToDocument(QPointF(width(), height()));
-		int x0 = (int)floor(pt0.x());
-		int y0 = (int)floor(pt0.y());
-		int x1 = (int)ceil(pt1.x());
-		int y1 = (int)ceil(pt1.y());
-		x0 = std::max(x0, 0);
-		y0 = std::max(y0, 0);
-		x1 = std::min(x1, document()->width());
-		y1 = std::min(y1, document()->height());
-		QRect r(x0, y0, x1 - x0, y1 - y0);
-		m->renderer->request(mainwindow(), r);
+		// 表示倍率で描いた画像を表示座標で要求する。ビューポートとドキュメントが重なる範囲だけ
+		const double scale = m->image_scale;
+		const QSize sz = imageSize();
+		const QRect view(0, 0, (int)floor(sz.width() * scale + 0.5), (int)floor(sz.height() * scale + 0.5));
+		const QRect r = QRect(-viewOrigin(), size()).intersected(view);
+		const uint64_t version = document()->version();
+		if (scale != m->view_scale || version != m->view_version) {
+			clearPrefetch(); // 編集や拡大縮小で先読みした画像は使えなくなる
+		}
+		QRegion target = r;
+		RenderedImage const &ri = m->rendered_image;
+		if (scale == m->view_scale && !r.isEmpty() && (r == m->view_rect || (!ri.image.isNull() && ri.scale == scale))) {
+			// 同じ倍率なら描画済みの画素を使い回し、前回から変更されたところと、
+			// スクロールで新しく見えたところだけ描く。表示座標はスクロールしても変わらない
+			target = m->pending;
+			if (!ri.image.isNull() && ri.scale == scale && ri.rect != r) {
+				target += shiftRenderedImage(r);
+			}
+			QRect changed = document()->changedRegion(m->view_version).boundingRect();
+			if (!changed.isEmpty()) {
+				target += ImageViewRenderer::viewRect(changed, scale);
+			}
+			target &= r;
+			// 先読みしてあるところは描かずに済む
+			if (!ri.image.isNull() && ri.rect == r) {
+				target -= applyPrefetched(target);
+			}
+		}
+		m->view_rect = r;
+		m->view_scale = scale;
+		m->view_version = version;
+		m->pending = target;
+		if (!target.isEmpty()) {
+			// 見えているところを先に描く。先読みは手が空いてからやり直す
+			m->prefetcher->abort(false);
+			m->prefetch_view = {};
+			std::vector<QRect> rects;
+			for (QRect const &rect : target.rects()) {
+				rects.push_back(rect);
+			}
+			// カーソルがビューの中にあればその周り、なければ中央から描く
+			QPoint focus = mapFromGlobal(QCursor::pos());
+			if (!rect().contains(focus)) {
+				focus = QPoint(width() / 2, height() / 2);
+			}
+			m->renderer->request(mainwindow(), rects, scale, version, focus - viewOrigin());
+		}
 	}
 
 	if (selection_outline) {
 		clearSelectionOutline();
-		m->outline_renderer->request(mainwindow(), QRect(0, 0, imagesize.width(), imagesize.height()));
+		m->outline_generation = m->outline_renderer->request(mainwindow(), QRect(0, 0, imagesize.width(), imagesize.height()));
 	}
 }
 
@@ -418,7 +776,7 @@ void ImageViewWidget::zoomOut()
 	zoomToCenter(m->image_scale / 2);
 }
 
-SelectionOutlineBitmap ImageViewWidget::renderSelectionOutlineBitmap(bool *abort)
+SelectionOutlineBitmap ImageViewWidget::renderSelectionOutlineBitmap(std::atomic_bool *abort)
 {
 	SelectionOutlineBitmap data;
 	int dw = document()->width();
@@ -485,42 +843,25 @@ void ImageViewWidget::paintEvent(QPaintEvent *)
 		int img_w = m->destination_rect.width();
 		int img_h = m->destination_rect.height();
 		if (img_w > 0 && img_h > 0) {
-			if (!m->rendered_image.image.isNull()) {
-				QImage image = m->rendered_image.image;
-				QPointF org = mapFromDocumentToViewport(QPointF(0, 0));
-				int ox = (int)floor(org.x() + 0.5);
-				int oy = (int)floor(org.y() + 0.5);
-				for (int y = 0; y < image.height(); y += 64) {
-					for (int x = 0; x < image.width(); x += 64) {
-						int src_x0 = m->rendered_image.rect.x() + x;
-						int src_y0 = m->rendered_image.rect.y() + y;
-						int src_x1 = m->rendered_image.rect.x() + std::min(x + 65, image.width());
-						int src_y1 = m->rendered_image.rect.y() + std::min(y + 65, image.height());
-						QPointF pt0(src_x0, src_y0);
-						QPointF pt1(src_x1, src_y1);
-						pt0 = mapFromDocumentToViewport(pt0);
-						pt1 = mapFromDocumentToViewport(pt1);
-						int dst_x0 = (int)floor(pt0.x() + 0.5);
-						int dst_y0 = (int)floor(pt0.y() + 0.5);
-						int dst_x1 = (int)floor(pt1.x() + 0.5);
-						int dst_y1 = (int)floor(pt1.y() + 0.5);
-						if (dst_x0 >= width()) continue;
-						if (dst_y0 >= height()) continue;
-						if (dst_x1 <= 0) continue;
-						if (dst_y1 <= 0) continue;
-						QRect sr(x, y, src_x1 - src_x0, src_y1 - src_y0);
-						QRect dr(dst_x0, dst_y0, dst_x1 - dst_x0, dst_y1 - dst_y0);
-						if (sr.width() > 0 && sr.height() > 0 && dr.width() > 0 && dr.height() > 0) {
-							QImage tmpimg(dr.width(), dr.height(), QImage::Format_RGBA8888);
-							{
-								QPainter pr2(&tmpimg);
-								pr2.setBrushOrigin(ox - dr.x(), oy - dr.y());
-								pr2.fillRect(tmpimg.rect(), TransparentCheckerBrush::brush());
-								pr2.drawImage(QRect(0, 0, dr.width(), dr.height()), image, sr);
+			RenderedImage const &ri = m->rendered_image;
+			if (!ri.image.isNull()) {
+				if (ri.scale == m->image_scale) {
+					// 表示倍率で描いてあるので、タイルごとの QPixmap を転送するだけ
+					const QPoint org = viewOrigin();
+					const QRect visible = QRect(-org, size()).intersected(ri.rect);
+					for (int y = visible.top() & ~63; y <= visible.bottom(); y += 64) {
+						for (int x = visible.left() & ~63; x <= visible.right(); x += 64) {
+							const QRect tile(x, y, 64, 64);
+							if (QPixmap const *pm = displayTile(tile)) {
+								pr.drawPixmap(tile.intersected(ri.rect).topLeft() + org, *pm);
 							}
-							pr.drawImage(dr.x(), dr.y(), tmpimg);
 						}
 					}
+				} else {
+					// 拡大縮小した直後は、新しい画像が届くまで前の画像を引き伸ばして描く
+					QPointF pt0(ri.rect.left() / ri.scale, ri.rect.top() / ri.scale);
+					QPointF pt1((ri.rect.right() + 1) / ri.scale, (ri.rect.bottom() + 1) / ri.scale);
+					pr.drawImage(QRectF(mapFromDocumentToViewport(pt0), mapFromDocumentToViewport(pt1)), ri.image);
 				}
 			}
 		}
@@ -672,5 +1013,6 @@ void ImageViewWidget::timerEvent(QTimerEvent *)
 {
 	m->stripe_animation = (m->stripe_animation + 1) & 7;
 	update();
+	prefetchAroundView();
 }
 
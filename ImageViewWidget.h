@@ -35,6 +35,14 @@ private:
 	void updateCursorAnchorPos();
 	void updateCenterAnchorPos();
 	void calcDestinationRect();
+	QPoint viewOrigin();
+	QRegion shiftRenderedImage(QRect const &r);
+	void invalidateDisplayTiles(QRect const &changed);
+	QPixmap const *displayTile(QRect const &tile);
+	void clearPrefetch();
+	void prefetchAroundView();
+	QRegion applyPrefetched(QRegion const &target);
+	void evictPrefetched(QRect const &area, size_t limit);
 	QBrush stripeBrush(bool blink);
 protected:
 	void resizeEvent(QResizeEvent *) override;
@@ -54,6 +62,7 @@ public:
 	QPointF mapFromDocumentToViewport(QPointF const &pos);
 
 	QMutex *synchronizer();
+	RenderQueueStats renderStats() const;
 
 	void showRect(const QPointF &start, const QPointF &end);
 	void hideRect();
@@ -71,12 +80,14 @@ public:
 	void setSelectionOutline(SelectionOutlineBitmap const &data);
 	void clearSelectionOutline();
 	QBitmap updateSelection_();
-	SelectionOutlineBitmap renderSelectionOutlineBitmap(bool *abort);
+	SelectionOutlineBitmap renderSelectionOutlineBitmap(std::atomic_bool *abort);
 	void stopRendering(bool wait);
+	void setPrefetchMargin(int margin);
 	bool isRectVisible() const;
 	void setCursor2(const QCursor &cursor);
 private slots:
 	void onRenderingCompleted(const RenderedImage &image);
+	void onPrefetchCompleted(const RenderedImage &image);
 	void onSelectionOutlineRenderingCompleted(const SelectionOutlineBitmap &data);
 signals:
 	void scaleChanged(double scale);
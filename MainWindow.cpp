@@ -5,18 +5,22 @@
 #include "ResizeDialog.h"
 #include "RoundBrushGenerator.h"
 #include "antialias.h"
+#include "cpu.h"
 #include "median.h"
 #include "resize.h"
 #include "ui_MainWindow.h"
 #include <QFileDialog>
 #include <QPainter>
 #include <stdint.h>
+#include <cstring>
 #include <QKeyEvent>
 #include <QDebug>
 #include <QBitmap>
 #include <QScreen>
 #include <QClipboard>
 #include <QElapsedTimer>
+#include <QActionGroup>
+#include <QMessageBox>
 
 struct MainWindow::Private {
 	Document doc;
@@ -80,6 +84,29 @@ MainWindow::MainWindow(QWidget *parent)
 
 	setColor(Qt::black, Qt::white);
 
+	{
+		// レイヤーの合成モード
+		QMenu *menu = ui->menu_Layer->addMenu(tr("&Blend Mode"));
+		QActionGroup *group = new QActionGroup(menu);
+		for (int i = 0; i <= (int)Document::BlendMode::Difference; i++) {
+			const Document::BlendMode mode = (Document::BlendMode)i;
+			QAction *a = menu->addAction(AlphaBlend::blend_mode_name(mode));
+			a->setCheckable(true);
+			a->setData(i);
+			group->addAction(a);
+			connect(a, &QAction::triggered, [this, mode](){
+				document()->setLayerBlendMode(document()->currentLayerIndex(), mode, synchronizer());
+				updateImageView();
+			});
+		}
+		connect(menu, &QMenu::aboutToShow, [this, group](){
+			Document::Layer const *layer = document()->current_layer();
+			for (QAction *a : group->actions()) {
+				a->setChecked(layer && a->data().toInt() == (int)layer->blend_mode_);
+			}
+		});
+	}
+
 	{
 		Brush b;
 		b.size = 85;
@@ -231,6 +258,8 @@ void MainWindow::resetView(bool fitview)
 
 void MainWindow::setImage(const QImage &image, bool fitview)
 {
+	document()->beginUndoStep();
+
 	clearDocument();
 
 	int w = image.width();
@@ -246,6 +275,8 @@ void MainWindow::setImage(const QImage &image, bool fitview)
 	opt.mode = Document::RenderOption::DirectCopy;
 	document()->renderToLayer(document()->current_layer(), layer, nullptr, opt, ui->widget_image_view->synchronizer(), nullptr);
 
+	document()->endUndoStep(ui->widget_image_view->synchronizer());
+
 	resetView(fitview);
 }
 
@@ -256,12 +287,17 @@ void MainWindow::setImage(QByteArray const &ba, bool fitview)
 	setImage(image, fitview);
 }
 
-QImage MainWindow::renderImage(QRect const &r, bool quickmask, bool *abort) const
+QImage MainWindow::renderImage(QRect const &r, bool quickmask, std::atomic_bool *abort, QImage::Format format) const
+{
+	return document()->renderToLayer(r, quickmask, ui->widget_image_view->synchronizer(), abort, format);
+}
+
+QImage MainWindow::renderReducedImage(QRect const &r, int level, std::atomic_bool *abort, QImage::Format format) const
 {
-	return document()->renderToLayer(r, quickmask, ui->widget_image_view->synchronizer(), abort);
+	return document()->renderReduced(r, level, ui->widget_image_view->synchronizer(), abort, format);
 }
 
-SelectionOutlineBitmap MainWindow::renderSelectionOutline(bool *abort) const
+SelectionOutlineBitmap MainWindow::renderSelectionOutline(std::atomic_bool *abort) const
 {
 	return ui->widget_image_view->renderSelectionOutlineBitmap(abort);
 }
@@ -303,19 +339,27 @@ void MainWindow::onHueChanged(int hue)
 
 void MainWindow::on_action_resize_triggered()
 {
-	QImage srcimage = renderFilterTargetImage();
-	QSize sz = srcimage.size();
+	const QSize sz = document()->size();
 
 	ResizeDialog dlg(this);
 	dlg.setImageSize(sz);
 	if (dlg.exec() == QDialog::Accepted) {
-		sz = dlg.imageSize();
-		unsigned int w = sz.width();
-		unsigned int h = sz.height();
+		QSize newsize = dlg.imageSize();
+		unsigned int w = newsize.width();
+		unsigned int h = newsize.height();
 		w = std::max(w, 1U);
 		h = std::max(h, 1U);
-		QImage newimage = resizeImage(srcimage, w, h, EnlargeMethod::Bicubic);
-		setImage(newimage, true);
+		// レイヤーごとに拡大縮小する。1回で元に戻せる
+		document()->beginUndoStep();
+		for (int i = 0; i < document()->layerCount(); i++) {
+			QImage image = document()->renderLayer(i, QRect(QPoint(), sz), synchronizer(), nullptr);
+			image = resizeImage(image, w, h, EnlargeMethod::Bicubic, true, ui->action_filter_linear_light->isChecked());
+			document()->setLayerImage(i, image, synchronizer());
+		}
+		document()->setSize(QSize(w, h));
+		clearSelection();
+		document()->endUndoStep(synchronizer());
+		resetView(true);
 	}
 }
 
@@ -328,6 +372,7 @@ void MainWindow::openFile(QString const &path)
 		ba = file.readAll();
 	}
 	setImage(ba, true);
+	document()->clearUndoHistory();
 }
 
 void MainWindow::on_action_file_open_triggered()
@@ -347,32 +392,41 @@ void MainWindow::on_action_file_save_as_triggered()
 	}
 }
 
+// フィルタは現在のレイヤーだけにかける
 QImage MainWindow::renderFilterTargetImage()
 {
 	QSize sz = document()->size();
-	QImage image = renderImage(QRect(0, 0, sz.width(), sz.height()), false, nullptr);
-	return image;
+	return document()->renderLayer(document()->currentLayerIndex(), QRect(0, 0, sz.width(), sz.height()), synchronizer(), nullptr);
+}
+
+// フィルタの結果で現在のレイヤーを置き換える。ほかのレイヤーとアンドゥの履歴はそのまま残す
+void MainWindow::setFilteredImage(QImage const &image)
+{
+	document()->beginUndoStep();
+	document()->setLayerImage(document()->currentLayerIndex(), image, synchronizer());
+	document()->endUndoStep(synchronizer());
+	updateImageView();
 }
 
 void MainWindow::on_action_filter_median_triggered()
 {
 	QImage image = renderFilterTargetImage();
 	image = filter_median(image, 10);
-	setImage(image, false);
+	setFilteredImage(image);
 }
 
 void MainWindow::on_action_filter_maximize_triggered()
 {
 	QImage image = renderFilterTargetImage();
 	image = filter_maximize(image, 10);
-	setImage(image, false);
+	setFilteredImage(image);
 }
 
 void MainWindow::on_action_filter_minimize_triggered()
 {
 	QImage image = renderFilterTargetImage();
 	image = filter_minimize(image, 10);
-	setImage(image, false);
+	setFilteredImage(image);
 }
 
 void MainWindow::on_action_filter_sepia_triggered()
@@ -398,19 +452,20 @@ void MainWindow::on_action_filter_sepia_triggered()
 			}
 		}
 	}
-	setImage(image, false);
+	setFilteredImage(image);
 }
 
-QImage filter_blur(QImage image, int radius);
+QImage filter_blur(QImage image, int radius, bool linear = false);
 
 void MainWindow::on_action_filter_blur_triggered()
 {
 	QImage image = renderFilterTargetImage();
 	int radius = 10;
-	image = filter_blur(image, radius);
-	image = filter_blur(image, radius);
-	image = filter_blur(image, radius);
-	setImage(image, false);
+	const bool linear = ui->action_filter_linear_light->isChecked();
+	image = filter_blur(image, radius, linear);
+	image = filter_blur(image, radius, linear);
+	image = filter_blur(image, radius, linear);
+	setFilteredImage(image);
 }
 
 
@@ -418,7 +473,7 @@ void MainWindow::on_action_filter_antialias_triggered()
 {
 	QImage image = renderFilterTargetImage();
 	filter_antialias(&image);
-	setImage(image, false);
+	setFilteredImage(image);
 }
 
 
@@ -468,6 +523,34 @@ void MainWindow::on_action_trim_triggered()
 void MainWindow::updateImageView()
 {
 	ui->widget_image_view->paintViewLater(true, false);
+	updateStatusBar();
+}
+
+void MainWindow::updateStatusBar()
+{
+	TileAllocator::Stats s = TileAllocator::stats();
+	auto MB = [](size_t n){
+		return QString::number(n / 1048576.0, 'f', 1);
+	};
+	QString text = QString("Tiles: %1 (%2 MB, peak %3 MB, reserved %4 MB)  Panels: %5")
+			.arg((qint64)s.live_tiles)
+			.arg(MB(s.live_bytes))
+			.arg(MB(s.peak_bytes))
+			.arg(MB(s.reserved_bytes))
+			.arg((qint64)s.live_panels);
+	TileStore::Stats t = TileStore::stats();
+	if (t.swapped_tiles > 0 || TileStore::budget() > 0) {
+		text += QString("  Swap: %1 tiles (file %2 MB)")
+				.arg((qint64)t.swapped_tiles)
+				.arg(MB(t.swap_file_bytes));
+	}
+	RenderQueueStats r = ui->widget_image_view->renderStats();
+	text += QString("  Render: %1 issued, %2 coalesced, %3 cancelled, %4 completed")
+			.arg((qint64)r.issued)
+			.arg((qint64)r.coalesced)
+			.arg((qint64)r.cancelled)
+			.arg((qint64)r.completed);
+	ui->statusBar->showMessage(text);
 }
 
 void MainWindow::updateSelectionOutline()
@@ -496,6 +579,10 @@ void MainWindow::paintLayer(Operation op, Document::Layer const &layer)
 	if (op == Operation::PaintToCurrentLayer) {
 		Document::RenderOption opt;
 		opt.brush_color = foregroundColor();
+		opt.blend_mode = currentBrush().blend_mode;
+		if (document()->isFixedPoint()) {
+			opt.gamma = AlphaBlend::GammaMethod::Fixed;
+		}
 		document()->paintToCurrentLayer(layer, opt, ui->widget_image_view->synchronizer(), nullptr);
 		return;
 	}
@@ -566,6 +653,7 @@ void MainWindow::drawBrush(bool one)
 
 void MainWindow::onPenDown(double x, double y)
 {
+	document()->beginUndoStep();
 	m->brush_bezier[0] = m->brush_bezier[1] = m->brush_bezier[2] = m->brush_bezier[3] = QPointF(x, y);
 	m->brush_next_distance = 0;
 	m->brush_t = 0;
@@ -592,6 +680,7 @@ void MainWindow::onPenUp(double x, double y)
 	(void)y;
 	updateImageView();
 	m->brush_next_distance = 0;
+	document()->endUndoStep(ui->widget_image_view->synchronizer());
 }
 
 QPointF MainWindow::pointOnDocument(int x, int y) const
@@ -1006,6 +1095,7 @@ bool MainWindow::eventFilter(QObject *watched, QEvent *event)
 								}
 							}
 							setImage(im, true);
+							document()->clearUndoHistory();
 							qDebug() << QString("%1ms").arg(t.elapsed());
 						}
 					}
@@ -1081,7 +1171,7 @@ void MainWindow::on_toolButton_rect_clicked()
 	changeTool(Tool::Rect);
 }
 
-SelectionOutlineBitmap MainWindow::renderSelectionOutlineBitmap(bool *abort)
+SelectionOutlineBitmap MainWindow::renderSelectionOutlineBitmap(std::atomic_bool *abort)
 {
 	return ui->widget_image_view->renderSelectionOutlineBitmap(abort);
 }
@@ -1100,16 +1190,53 @@ void MainWindow::on_action_new_triggered()
 		if (dlg.from() == NewDialog::From::New) {
 			QImage image(sz.width(), sz.height(), QImage::Format_RGBA8888);
 			setImage(image, true);
+			document()->clearUndoHistory();
 			return;
 		}
 		if (dlg.from() == NewDialog::From::Clipboard) {
 			QImage image = selectedImage();
 			setImage(image, true);
+			document()->clearUndoHistory();
 			return;
 		}
 	}
 }
 
+void MainWindow::on_action_edit_undo_triggered()
+{
+	QSize sz = document()->size();
+	if (document()->undo(synchronizer())) {
+		resetView(document()->size() != sz);
+	}
+}
+
+void MainWindow::on_action_edit_redo_triggered()
+{
+	QSize sz = document()->size();
+	if (document()->redo(synchronizer())) {
+		resetView(document()->size() != sz);
+	}
+}
+
+void MainWindow::on_action_layer_new_triggered()
+{
+	document()->insertLayer(document()->currentLayerIndex() + 1, synchronizer());
+	updateImageView();
+}
+
+void MainWindow::on_action_layer_delete_triggered()
+{
+	document()->removeLayer(document()->currentLayerIndex(), synchronizer());
+	updateImageView();
+}
+
+// 合成とブラシの描画を固定小数点に切り替える。表示は全体を描き直す
+void MainWindow::on_action_layer_fixed_point_triggered()
+{
+	document()->setFixedPoint(ui->action_layer_fixed_point->isChecked(), synchronizer());
+	updateImageView();
+}
+
 void MainWindow::on_action_select_rectangle_triggered()
 {
 	if (isRectValid()) {
@@ -1123,6 +1250,23 @@ void MainWindow::on_action_select_rectangle_triggered()
 	}
 }
 
+void MainWindow::on_action_about_triggered()
+{
+	// 実行時に選んだ画素処理のカーネル（EUCLASE_ISA で上限を変えられる）
+	euclase::CpuFeatures const &f = euclase::cpuFeatures();
+	QStringList features;
+	if (f.sse2) features << "SSE2";
+	if (f.avx2) features << "AVX2";
+	if (f.avx512) features << "AVX-512";
+	if (features.isEmpty()) features << "none";
+	QString text;
+	text += "<b>Euclase</b><br><br>";
+	text += tr("CPU features: %1").arg(features.join(' ')) + "<br>";
+	text += tr("Pixel kernels: %1").arg(euclase::isaName(euclase::cpuIsa())) + "<br>";
+	text += tr("Blend span: %1").arg(AlphaBlend::span_kernel_name());
+	QMessageBox::about(this, tr("About Euclase"), text);
+}
+
 void MainWindow::test()
 {
 }
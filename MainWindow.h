@@ -49,6 +49,7 @@ private:
 	void drawBrush(bool one);
 	void test();
 	void updateImageView();
+	void updateStatusBar();
 	void updateSelectionOutline();
 	void setColorRed(int value);
 	void setColorGreen(int value);
@@ -57,6 +58,7 @@ private:
 	void setColorSaturation(int value);
 	void setColorValue(int value);
 	QImage renderFilterTargetImage();
+	void setFilteredImage(QImage const &image);
 	void onSelectionChanged();
 	void clearSelection();
 	QImage selectedImage() const;
@@ -82,7 +84,8 @@ public:
 	QMutex *synchronizer() const;
 
 	void fitView();
-	QImage renderImage(const QRect &r, bool quickmask, bool *abort) const;
+	QImage renderImage(const QRect &r, bool quickmask, std::atomic_bool *abort, QImage::Format format = QImage::Format_RGBA8888) const;
+	QImage renderReducedImage(const QRect &r, int level, std::atomic_bool *abort, QImage::Format format = QImage::Format_RGBA8888) const;
 	QRect selectionRect() const;
 	void openFile(const QString &path);
 	int documentWidth() const;
@@ -91,8 +94,8 @@ public:
 	const Brush &currentBrush() const;
 	void changeTool(Tool tool);
 	MainWindow::Tool currentTool() const;
-	SelectionOutlineBitmap renderSelectionOutline(bool *abort) const;
-	SelectionOutlineBitmap renderSelectionOutlineBitmap(bool *abort);
+	SelectionOutlineBitmap renderSelectionOutline(std::atomic_bool *abort) const;
+	SelectionOutlineBitmap renderSelectionOutlineBitmap(std::atomic_bool *abort);
 	void setColor(QColor primary_color, QColor secondary_color);
 public slots:
 	void setCurrentColor(const QColor &primary_color);
@@ -137,8 +140,14 @@ private slots:
 	void on_toolButton_brush_clicked();
 	void on_toolButton_rect_clicked();
 	void on_action_edit_copy_triggered();
+	void on_action_edit_undo_triggered();
+	void on_action_edit_redo_triggered();
 	void on_action_new_triggered();
+	void on_action_layer_new_triggered();
+	void on_action_layer_delete_triggered();
+	void on_action_layer_fixed_point_triggered();
 	void on_action_select_rectangle_triggered();
+	void on_action_about_triggered();
 
 	// QObject interface
 	void on_action_clear_bounds_triggered();
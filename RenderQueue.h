@@ -0,0 +1,146 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// 描画スレッドへの要求の受け渡し
+// まだ取り出されていない要求は新しい要求で置き換える（まとめる）。
+// 要求ごとに世代番号と中止フラグを持たせ、受け取り側は古い世代の結果を捨てられるようにする
+
+using CancelToken = std::shared_ptr<std::atomic_bool>;
+
+struct RenderQueueStats {
+	uint64_t issued = 0;    // 要求の数
+	uint64_t coalesced = 0; // 描き終わる前に新しい要求にまとめられた数
+	uint64_t cancelled = 0; // 中止した数
+	uint64_t completed = 0; // 最後まで描いた数
+};
+
+template <typename T> class RenderQueue {
+public:
+	struct Request {
+		T data;
+		uint64_t generation = 0;
+		CancelToken cancel;
+		bool isCancelled() const
+		{
+			return cancel && cancel->load();
+		}
+	};
+	enum class Outcome {
+		Completed,
+		Coalesced,
+		Cancelled,
+	};
+private:
+	mutable QMutex mutex_;
+	QWaitCondition wake_; // 要求が来た、または終了する
+	QWaitCondition idle_; // 処理中の要求が終わった
+	Request pending_;
+	std::atomic_bool has_pending_{false};
+	CancelToken running_; // 処理中の要求の中止フラグ
+	bool quit_ = false;
+	std::atomic<uint64_t> generation_{0};
+	std::atomic<uint64_t> issued_{0};
+	std::atomic<uint64_t> coalesced_{0};
+	std::atomic<uint64_t> cancelled_{0};
+	std::atomic<uint64_t> completed_{0};
+public:
+	// 要求を積んで世代番号を返す。取り出されていない要求があれば置き換える
+	uint64_t post(T const &data)
+	{
+		QMutexLocker lock(&mutex_);
+		if (has_pending_) coalesced_++;
+		pending_.data = data;
+		pending_.generation = ++generation_;
+		pending_.cancel = std::make_shared<std::atomic_bool>(false);
+		has_pending_ = true;
+		issued_++;
+		wake_.wakeAll();
+		return pending_.generation;
+	}
+
+	// 描画スレッドが要求を取り出す。要求が来るまで待ち、終了するときは false を返す
+	bool take(Request *out)
+	{
+		QMutexLocker lock(&mutex_);
+		while (!has_pending_ && !quit_) {
+			wake_.wait(&mutex_);
+		}
+		if (quit_) return false;
+		*out = pending_;
+		pending_ = Request();
+		has_pending_ = false;
+		running_ = out->cancel;
+		return true;
+	}
+
+	// 描画中に新しい要求が来たか（区切りのよいところで譲るのに使う）
+	bool hasPending() const
+	{
+		return has_pending_;
+	}
+
+	// 取り出した要求の処理が終わった
+	void finish(Outcome outcome)
+	{
+		QMutexLocker lock(&mutex_);
+		switch (outcome) {
+		case Outcome::Completed: completed_++; break;
+		case Outcome::Coalesced: coalesced_++; break;
+		case Outcome::Cancelled: cancelled_++; break;
+		}
+		running_.reset();
+		idle_.wakeAll();
+	}
+
+	// 未着手の要求を捨て、処理中の要求を中止する。wait なら処理中の要求が終わるまで待つ
+	void cancel(bool wait)
+	{
+		QMutexLocker lock(&mutex_);
+		if (has_pending_) {
+			pending_ = Request();
+			has_pending_ = false;
+			cancelled_++;
+		}
+		if (running_) {
+			running_->store(true);
+			if (wait) {
+				while (running_) {
+					idle_.wait(&mutex_);
+				}
+			}
+		}
+	}
+
+	// 描画スレッドを終わらせる
+	void quit()
+	{
+		QMutexLocker lock(&mutex_);
+		quit_ = true;
+		if (running_) running_->store(true);
+		wake_.wakeAll();
+	}
+
+	// 最後に積んだ要求の世代番号
+	uint64_t generation() const
+	{
+		return generation_;
+	}
+
+	RenderQueueStats stats() const
+	{
+		RenderQueueStats s;
+		s.issued = issued_;
+		s.coalesced = coalesced_;
+		s.cancelled = cancelled_;
+		s.completed = completed_;
+		return s;
+	}
+};
+
+#endif // RENDERQUEUE_H
@@ -1,10 +1,13 @@
 #ifndef ROUNDBRUSHGENERATOR_H
 #define ROUNDBRUSHGENERATOR_H
 
+#include "AlphaBlend.h"
+
 class Brush {
 public:
 	double size = 200;
 	double softness = 1;
+	AlphaBlend::BlendMode blend_mode = AlphaBlend::BlendMode::Normal;
 };
 
 class RoundBrushGenerator {
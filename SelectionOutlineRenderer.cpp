@@ -10,36 +10,44 @@ SelectionOutlineRenderer::SelectionOutlineRenderer(QObject *parent)
 
 SelectionOutlineRenderer::~SelectionOutlineRenderer()
 {
-	abort();
+	queue_.quit();
+	wait();
 }
 
 void SelectionOutlineRenderer::run()
 {
-	while (requested_) {
-		requested_ = false;
-		SelectionOutlineBitmap data;
-		if (!abort_) {
-			data = mainwindow_->renderSelectionOutlineBitmap(&abort_);
+	Queue::Request req;
+	while (queue_.take(&req)) {
+		SelectionOutlineBitmap data = req.data.mainwindow->renderSelectionOutlineBitmap(req.cancel.get());
+		if (req.isCancelled()) {
+			queue_.finish(Queue::Outcome::Cancelled);
+			continue;
 		}
-		if (abort_) break;
+		data.generation = req.generation;
+		queue_.finish(Queue::Outcome::Completed);
 		emit done(data);
 	}
 }
 
-void SelectionOutlineRenderer::request(MainWindow *mw, const QRect &rect)
+// 輪郭の描画を要求し、その世代番号を返す。まだ始まっていない要求は置き換える
+uint64_t SelectionOutlineRenderer::request(MainWindow *mw, const QRect &rect)
 {
-	mainwindow_ = mw;
-	rect_ = rect;
-	requested_ = true;
-	abort_ = false;
+	Job job;
+	job.mainwindow = mw;
+	job.rect = rect;
+	const uint64_t generation = queue_.post(job);
 	if (!isRunning()) {
 		start();
 	}
+	return generation;
 }
 
-void SelectionOutlineRenderer::abort()
+void SelectionOutlineRenderer::abort(bool wait)
 {
-	abort_ = true;
-	wait();
+	queue_.cancel(wait);
 }
 
+RenderQueueStats SelectionOutlineRenderer::stats() const
+{
+	return queue_.stats();
+}
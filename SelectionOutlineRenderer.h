@@ -1,6 +1,7 @@
 #ifndef SELECTIONOUTLINERENDERER_H
 #define SELECTIONOUTLINERENDERER_H
 
+#include "RenderQueue.h"
 #include <QBitmap>
 #include <QRect>
 #include <QThread>
@@ -18,23 +19,27 @@ public:
 	}
 	QPoint point;
 	QBitmap bitmap;
+	uint64_t generation = 0; // 要求の世代番号（SelectionOutlineRenderer::request の戻り値）
 };
 Q_DECLARE_METATYPE(SelectionOutlineBitmap)
 
 class SelectionOutlineRenderer : public QThread {
 	Q_OBJECT
 private:
-	volatile bool requested_ = false;
-	MainWindow *mainwindow_;
-	QRect rect_;
-	bool abort_ = false;
+	struct Job {
+		MainWindow *mainwindow = nullptr;
+		QRect rect;
+	};
+	using Queue = RenderQueue<Job>;
+	Queue queue_;
 protected:
 	void run();
 public:
 	explicit SelectionOutlineRenderer(QObject *parent = nullptr);
 	~SelectionOutlineRenderer() override;
-	void request(MainWindow *mw, QRect const &rect);
-	void abort();
+	uint64_t request(MainWindow *mw, QRect const &rect);
+	void abort(bool wait);
+	RenderQueueStats stats() const;
 signals:
 	void done(SelectionOutlineBitmap const &data);
 };
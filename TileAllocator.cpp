@@ -0,0 +1,170 @@
+#include "TileAllocator.h"
+#include <QMutex>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+namespace {
+
+const size_t UNITS_PER_SLAB = 64;
+
+class FixedSizePool {
+private:
+	size_t unit_;
+	std::vector<void *> slabs_;
+	void *free_ = nullptr;
+public:
+	size_t live = 0;
+
+	explicit FixedSizePool(size_t unit)
+		: unit_((unit + TileAllocator::ALIGNMENT - 1) & ~(size_t)(TileAllocator::ALIGNMENT - 1))
+	{
+	}
+
+	size_t unit() const
+	{
+		return unit_;
+	}
+
+	size_t reserved() const
+	{
+		return slabs_.size() * unit_ * UNITS_PER_SLAB;
+	}
+
+	void *alloc()
+	{
+		if (!free_) {
+			// スラブを確保して、キャッシュライン境界に揃えた単位で空きリストにつなぐ
+			void *raw = malloc(unit_ * UNITS_PER_SLAB + TileAllocator::ALIGNMENT - 1);
+			if (!raw) throw std::bad_alloc();
+			slabs_.push_back(raw);
+			uintptr_t a = ((uintptr_t)raw + TileAllocator::ALIGNMENT - 1) & ~(uintptr_t)(TileAllocator::ALIGNMENT - 1);
+			uint8_t *base = reinterpret_cast<uint8_t *>(a);
+			for (size_t i = UNITS_PER_SLAB; i > 0; i--) {
+				void *p = base + (i - 1) * unit_;
+				*reinterpret_cast<void **>(p) = free_;
+				free_ = p;
+			}
+		}
+		void *p = free_;
+		free_ = *reinterpret_cast<void **>(p);
+		live++;
+		return p;
+	}
+
+	void release(void *p)
+	{
+		*reinterpret_cast<void **>(p) = free_;
+		free_ = p;
+		live--;
+	}
+};
+
+struct Pools {
+	QMutex mutex;
+	FixedSizePool panel { TileAllocator::PANEL_SIZE };
+	FixedSizePool rgba { TileAllocator::TILE_SIZE * TileAllocator::TILE_SIZE * 4 };
+	FixedSizePool gray { TileAllocator::TILE_SIZE * TileAllocator::TILE_SIZE };
+	size_t peak_bytes = 0;
+
+	size_t liveBytes() const
+	{
+		return rgba.live * rgba.unit() + gray.live * gray.unit();
+	}
+};
+
+Pools *pools()
+{
+	static Pools *p = new Pools; // 終了時に残っているタイルがあるので解放しない
+	return p;
+}
+
+void *allocateTile(FixedSizePool *pool)
+{
+	Pools *p = pools();
+	QMutexLocker lock(&p->mutex);
+	void *ptr = pool->alloc();
+	p->peak_bytes = std::max(p->peak_bytes, p->liveBytes());
+	return ptr;
+}
+
+void releaseRGBATile(void *ptr)
+{
+	Pools *p = pools();
+	QMutexLocker lock(&p->mutex);
+	p->rgba.release(ptr);
+}
+
+void releaseGrayTile(void *ptr)
+{
+	Pools *p = pools();
+	QMutexLocker lock(&p->mutex);
+	p->gray.release(ptr);
+}
+
+} // namespace
+
+void *TileAllocator::allocatePanel(size_t size)
+{
+	Pools *p = pools();
+	if (size > p->panel.unit()) {
+		void *ptr = malloc(size);
+		if (!ptr) throw std::bad_alloc();
+		return ptr;
+	}
+	QMutexLocker lock(&p->mutex);
+	return p->panel.alloc();
+}
+
+void TileAllocator::freePanel(void *ptr, size_t size)
+{
+	Pools *p = pools();
+	if (size > p->panel.unit()) {
+		free(ptr);
+		return;
+	}
+	QMutexLocker lock(&p->mutex);
+	p->panel.release(ptr);
+}
+
+// タイルと同じ大きさの画像はプールの領域を使う。それ以外は通常の QImage
+QImage TileAllocator::newTileImage(int w, int h, QImage::Format format)
+{
+	if (w == TILE_SIZE && h == TILE_SIZE) {
+		if (format == QImage::Format_RGBA8888 || format == QImage::Format_RGBA8888_Premultiplied) {
+			uchar *ptr = reinterpret_cast<uchar *>(allocateTile(&pools()->rgba));
+			return QImage(ptr, w, h, w * 4, format, releaseRGBATile, ptr);
+		}
+		if (format == QImage::Format_Grayscale8) {
+			uchar *ptr = reinterpret_cast<uchar *>(allocateTile(&pools()->gray));
+			return QImage(ptr, w, h, w, format, releaseGrayTile, ptr);
+		}
+	}
+	return QImage(w, h, format);
+}
+
+QImage TileAllocator::copyTileImage(QImage const &image)
+{
+	QImage newimage = newTileImage(image.width(), image.height(), image.format());
+	const int n = std::min(image.bytesPerLine(), newimage.bytesPerLine());
+	for (int y = 0; y < image.height(); y++) {
+		memcpy(newimage.scanLine(y), image.scanLine(y), n);
+	}
+	return newimage;
+}
+
+TileAllocator::Stats TileAllocator::stats()
+{
+	Pools *p = pools();
+	QMutexLocker lock(&p->mutex);
+	Stats s;
+	s.live_panels = p->panel.live;
+	s.live_tiles = p->rgba.live + p->gray.live;
+	s.live_bytes = p->liveBytes();
+	s.peak_bytes = p->peak_bytes;
+	s.reserved_bytes = p->panel.reserved() + p->rgba.reserved() + p->gray.reserved();
+	return s;
+}
@@ -0,0 +1,31 @@
+#ifndef TILEALLOCATOR_H
+#define TILEALLOCATOR_H
+
+#include <QImage>
+#include <cstddef>
+
+// Document のパネルとタイル画素を固定長のスラブから割り当てる
+class TileAllocator {
+public:
+	enum {
+		TILE_SIZE = 64,
+		ALIGNMENT = 64,
+		PANEL_SIZE = 128, // パネル（Document::Image, Document::Block）1つ分。Document.h で収まることを確かめる
+	};
+
+	struct Stats {
+		size_t live_panels = 0;
+		size_t live_tiles = 0;
+		size_t live_bytes = 0;
+		size_t peak_bytes = 0;
+		size_t reserved_bytes = 0;
+	};
+
+	static void *allocatePanel(size_t size);
+	static void freePanel(void *p, size_t size);
+	static QImage newTileImage(int w, int h, QImage::Format format);
+	static QImage copyTileImage(QImage const &image);
+	static Stats stats();
+};
+
+#endif // TILEALLOCATOR_H
@@ -0,0 +1,246 @@
+#include "TileStore.h"
+#include "TileAllocator.h"
+#include <QDebug>
+#include <QDir>
+#include <QMutex>
+#include <QTemporaryFile>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+const int SLOT_BYTES = TileAllocator::TILE_SIZE * TileAllocator::TILE_SIZE * 4;
+const int SLOTS_PER_CHUNK = 1024; // 16MB ずつマップする
+const size_t MIN_RESIDENT_TILES = 256; // 描いている辺りのタイルを追い出しては読み戻すことにならないための下限
+
+struct Store {
+	QMutex mutex;
+	size_t budget = 0; // 0: 無制限
+	TileStore::Node head; // 先頭が最近使われたタイル
+	size_t resident_tiles = 0;
+	size_t resident_bytes = 0;
+	size_t swapped_tiles = 0;
+
+	QTemporaryFile *file = nullptr;
+	bool failed = false;
+	std::vector<uchar *> chunks;
+	std::vector<int> free_slots;
+
+	Store()
+	{
+		head.prev = head.next = &head;
+	}
+
+	void link(TileStore::Node *node)
+	{
+		node->prev = &head;
+		node->next = head.next;
+		head.next->prev = node;
+		head.next = node;
+	}
+
+	void unlink(TileStore::Node *node)
+	{
+		node->prev->next = node->next;
+		node->next->prev = node->prev;
+		node->prev = node->next = nullptr;
+	}
+
+	uchar *slotData(int slot)
+	{
+		return chunks[slot / SLOTS_PER_CHUNK] + (size_t)(slot % SLOTS_PER_CHUNK) * SLOT_BYTES;
+	}
+
+	int allocSlot()
+	{
+		if (free_slots.empty()) {
+			if (failed) return -1;
+			if (!file) {
+				file = new QTemporaryFile(QDir::tempPath() + "/euclase-swap-XXXXXX");
+				if (!file->open()) {
+					qDebug() << "failed to create the tile swap file";
+					failed = true;
+					return -1;
+				}
+			}
+			const qint64 chunk_bytes = (qint64)SLOTS_PER_CHUNK * SLOT_BYTES;
+			const qint64 offset = (qint64)chunks.size() * chunk_bytes;
+			uchar *p = nullptr;
+			if (file->resize(offset + chunk_bytes)) {
+				p = file->map(offset, chunk_bytes);
+			}
+			if (!p) {
+				qDebug() << "failed to extend the tile swap file";
+				failed = true;
+				return -1;
+			}
+			const int base = (int)chunks.size() * SLOTS_PER_CHUNK;
+			chunks.push_back(p);
+			for (int i = SLOTS_PER_CHUNK - 1; i >= 0; i--) {
+				free_slots.push_back(base + i);
+			}
+		}
+		int slot = free_slots.back();
+		free_slots.pop_back();
+		return slot;
+	}
+
+	bool evict(TileStore::Node *node)
+	{
+		QImage *image = node->image;
+		const int bpl = image->width() * image->depth() / 8;
+		if (bpl * image->height() > SLOT_BYTES) return false;
+		int slot = allocSlot();
+		if (slot < 0) return false;
+		uchar *dst = slotData(slot);
+		for (int y = 0; y < image->height(); y++) {
+			memcpy(dst + y * bpl, image->constScanLine(y), bpl);
+		}
+		resident_tiles--;
+		resident_bytes -= node->bytes;
+		unlink(node);
+		node->slot = slot;
+		node->size = image->size();
+		node->format = image->format();
+		*image = QImage();
+		swapped_tiles++;
+		return true;
+	}
+
+	void load(TileStore::Node *node)
+	{
+		QImage *image = node->image;
+		*image = TileAllocator::newTileImage(node->size.width(), node->size.height(), node->format);
+		const int bpl = image->width() * image->depth() / 8;
+		uchar const *src = slotData(node->slot);
+		for (int y = 0; y < image->height(); y++) {
+			memcpy(image->scanLine(y), src + y * bpl, bpl);
+		}
+		free_slots.push_back(node->slot);
+		node->slot = -1;
+		swapped_tiles--;
+		link(node);
+		resident_tiles++;
+		resident_bytes += node->bytes;
+	}
+
+	void trim()
+	{
+		if (budget == 0) return;
+		while (resident_bytes > budget && resident_tiles > MIN_RESIDENT_TILES) {
+			if (!evict(head.prev)) break;
+		}
+	}
+};
+
+Store *store()
+{
+	static Store *s = new Store;
+	return s;
+}
+
+} // namespace
+
+// 上限を超えた分は次の trim() で追い出す
+void TileStore::setBudget(size_t bytes)
+{
+	Store *s = store();
+	QMutexLocker lock(&s->mutex);
+	s->budget = bytes;
+}
+
+size_t TileStore::budget()
+{
+	Store *s = store();
+	QMutexLocker lock(&s->mutex);
+	return s->budget;
+}
+
+// 上限を超えている分を、最近使われていないタイルから追い出す
+// 追い出すとタイルの画像（Document::Image::image_）が空になるので、ほかのスレッドが
+// タイルに触れていないとき、つまりドキュメントの sync をロックしている書き込み側からだけ呼ぶ。
+// 描画スレッドは sync をロックして acquire した共有コピーを読むので、追い出されても影響しない
+void TileStore::trim()
+{
+	Store *s = store();
+	QMutexLocker lock(&s->mutex);
+	s->trim();
+}
+
+void TileStore::track(Node *node, QImage *image)
+{
+	if (node->image) return;
+	Store *s = store();
+	QMutexLocker lock(&s->mutex);
+	node->image = image;
+	node->bytes = (size_t)image->bytesPerLine() * image->height();
+	s->link(node);
+	s->resident_tiles++;
+	s->resident_bytes += node->bytes;
+}
+
+// タイルを使う前に呼ぶ。追い出されていれば読み戻す
+void TileStore::touch(Node *node)
+{
+	if (!node->image) return;
+	Store *s = store();
+	QMutexLocker lock(&s->mutex);
+	if (node->isEvicted()) {
+		s->load(node);
+	} else if (s->head.next != node) {
+		s->unlink(node);
+		s->link(node);
+	}
+}
+
+// 別のスレッドから読むための画像の共有コピーを返す。追い出されていれば読み戻す
+QImage TileStore::acquire(Node *node, QImage const &image)
+{
+	if (!node->image) return image;
+	Store *s = store();
+	QMutexLocker lock(&s->mutex);
+	if (node->isEvicted()) {
+		s->load(node);
+	} else if (s->head.next != node) {
+		s->unlink(node);
+		s->link(node);
+	}
+	return *node->image;
+}
+
+// 追い出されていても元の大きさを返す
+QSize TileStore::size(Node const *node, QImage const &image)
+{
+	if (!node->image) return image.size(); // 追跡していないタイル（写しなど）
+	Store *s = store();
+	QMutexLocker lock(&s->mutex);
+	return node->isEvicted() ? node->size : image.size();
+}
+
+void TileStore::forget(Node *node)
+{
+	Store *s = store();
+	QMutexLocker lock(&s->mutex);
+	if (node->isEvicted()) {
+		s->free_slots.push_back(node->slot);
+		node->slot = -1;
+		s->swapped_tiles--;
+	} else {
+		s->unlink(node);
+		s->resident_tiles--;
+		s->resident_bytes -= node->bytes;
+	}
+	node->image = nullptr;
+}
+
+TileStore::Stats TileStore::stats()
+{
+	Store *s = store();
+	QMutexLocker lock(&s->mutex);
+	Stats st;
+	st.resident_tiles = s->resident_tiles;
+	st.resident_bytes = s->resident_bytes;
+	st.swapped_tiles = s->swapped_tiles;
+	st.swap_file_bytes = s->chunks.size() * (size_t)SLOTS_PER_CHUNK * SLOT_BYTES;
+	return st;
+}
@@ -0,0 +1,59 @@
+#ifndef TILESTORE_H
+#define TILESTORE_H
+
+#include <QImage>
+#include <QSize>
+#include <cstddef>
+
+// 使われていないタイルをスワップファイルに追い出し、常駐するタイルの量を制限する
+class TileStore {
+public:
+	// Document::Image に埋め込む LRU のノード
+	struct Node {
+		Node *prev = nullptr;
+		Node *next = nullptr;
+		QImage *image = nullptr; // 追跡中のタイル画像
+		int slot = -1; // スワップファイル上の位置（-1: メモリ上にある）
+		size_t bytes = 0;
+		QSize size;
+		QImage::Format format = QImage::Format_Invalid;
+
+		Node() = default;
+		Node(Node const &)
+		{
+		}
+		Node &operator = (Node const &)
+		{
+			return *this;
+		}
+		~Node()
+		{
+			if (image) {
+				TileStore::forget(this);
+			}
+		}
+		bool isEvicted() const
+		{
+			return slot >= 0;
+		}
+	};
+
+	struct Stats {
+		size_t resident_tiles = 0;
+		size_t resident_bytes = 0;
+		size_t swapped_tiles = 0;
+		size_t swap_file_bytes = 0;
+	};
+
+	static void setBudget(size_t bytes);
+	static size_t budget();
+	static void trim();
+	static void track(Node *node, QImage *image);
+	static void touch(Node *node);
+	static QImage acquire(Node *node, QImage const &image);
+	static QSize size(Node const *node, QImage const &image);
+	static void forget(Node *node);
+	static Stats stats();
+};
+
+#endif // TILESTORE_H
@@ -10,7 +10,7 @@ QBrush TransparentCheckerBrush::brush()
 		for (int y = 0; y < 16; y++) {
 			uint8_t *p = img.scanLine(y);
 			for (int x = 0; x < 16; x++) {
-				p[x] = ((x ^ y) & 8) ? 240 : 192;
+				p[x] = shade(x, y);
 
 			}
 		}
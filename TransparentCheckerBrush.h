@@ -8,6 +8,12 @@ class TransparentCheckerBrush {
 private:
 public:
 	static QBrush brush();
+
+	// (x, y) の明るさ。16x16 の市松模様
+	static int shade(int x, int y)
+	{
+		return ((x ^ y) & 8) ? 240 : 192;
+	}
 };
 
 
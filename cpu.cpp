@@ -0,0 +1,137 @@
+#include "cpu.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+
+#if defined(EUCLASE_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace {
+
+#if defined(EUCLASE_X86)
+
+void cpuid(uint32_t leaf, uint32_t sub, uint32_t *r)
+{
+#if defined(_MSC_VER)
+	int v[4];
+	__cpuidex(v, (int)leaf, (int)sub);
+	for (int i = 0; i < 4; i++) r[i] = (uint32_t)v[i];
+#else
+	__cpuid_count(leaf, sub, r[0], r[1], r[2], r[3]);
+#endif
+}
+
+uint64_t xgetbv0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t lo, hi;
+	__asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+euclase::CpuFeatures detect()
+{
+	euclase::CpuFeatures f;
+	uint32_t r[4]; // eax, ebx, ecx, edx
+	cpuid(0, 0, r);
+	const uint32_t max_leaf = r[0];
+	if (max_leaf < 1) return f;
+	cpuid(1, 0, r);
+	f.sse2 = (r[3] >> 26) & 1;
+	const bool osxsave = (r[2] >> 27) & 1;
+	const bool avx = (r[2] >> 28) & 1;
+	const uint64_t xcr0 = osxsave ? xgetbv0() : 0;
+	const bool ymm = (xcr0 & 0x06) == 0x06; // XMM, YMM
+	const bool zmm = (xcr0 & 0xe6) == 0xe6; // XMM, YMM, opmask, ZMM
+	if (max_leaf >= 7) {
+		cpuid(7, 0, r);
+		f.avx2 = avx && ymm && ((r[1] >> 5) & 1);
+		f.avx512 = f.avx2 && zmm && ((r[1] >> 16) & 1); // カーネルは F だけを使う
+	}
+	return f;
+}
+
+#else
+
+euclase::CpuFeatures detect()
+{
+	return {};
+}
+
+#endif
+
+std::atomic<int> isa_limit{(int)euclase::Isa::AVX512};
+
+} // namespace
+
+euclase::CpuFeatures const &euclase::cpuFeatures()
+{
+	static const CpuFeatures features = detect();
+	return features;
+}
+
+euclase::Isa euclase::detectedIsa()
+{
+	CpuFeatures const &f = cpuFeatures();
+	if (f.avx512) return Isa::AVX512;
+	if (f.avx2) return Isa::AVX2;
+	if (f.sse2) return Isa::SSE2;
+	return Isa::Generic;
+}
+
+euclase::Isa euclase::cpuIsa()
+{
+	return (Isa)std::min((int)detectedIsa(), isa_limit.load(std::memory_order_relaxed));
+}
+
+void euclase::setCpuIsaLimit(Isa limit)
+{
+	isa_limit = (int)limit;
+}
+
+bool euclase::parseIsa(char const *name, Isa *out)
+{
+	// 大文字小文字と '-' '.' を区別しない（"avx512" や "AVX-512" でもよい）
+	auto equals = [](char const *a, char const *b){
+		auto skip = [](char const *p){
+			while (*p == '-' || *p == '.') p++;
+			return p;
+		};
+		while (1) {
+			a = skip(a);
+			b = skip(b);
+			if (*a == 0 || *b == 0) return *a == *b;
+			if (tolower((unsigned char)*a) != tolower((unsigned char)*b)) return false;
+			a++;
+			b++;
+		}
+	};
+	for (Isa isa : { Isa::Generic, Isa::SSE2, Isa::AVX2, Isa::AVX512 }) {
+		if (equals(name, isaName(isa))) {
+			*out = isa;
+			return true;
+		}
+	}
+	return false;
+}
+
+char const *euclase::isaName(Isa isa)
+{
+	switch (isa) {
+	case Isa::Generic: return "generic";
+	case Isa::SSE2: return "SSE2";
+	case Isa::AVX2: return "AVX2";
+	case Isa::AVX512: return "AVX-512";
+	}
+	return "";
+}
@@ -0,0 +1,40 @@
+#ifndef CPU_H
+#define CPU_H
+
+// 実行時の命令セットの判定
+// 画素処理のカーネルは命令セットごとに関数の属性で作り分け、起動後に CPU を調べて選ぶ。
+// ビルド時のオプション（-mavx2 など）は不要なので、1つのバイナリでどの CPU でも速い版が動く
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define EUCLASE_X86
+#define EUCLASE_TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define EUCLASE_X86
+#define EUCLASE_TARGET(isa)
+#endif
+
+namespace euclase {
+
+enum class Isa {
+	Generic,
+	SSE2,
+	AVX2,
+	AVX512, // F
+};
+
+struct CpuFeatures {
+	bool sse2 = false;
+	bool avx2 = false; // OS が YMM レジスタを保存する場合だけ
+	bool avx512 = false; // AVX-512F。OS が ZMM レジスタを保存する場合だけ
+};
+
+CpuFeatures const &cpuFeatures(); // 最初の呼び出しで CPUID を調べる
+Isa detectedIsa(); // CPU が対応している最上位の命令セット
+Isa cpuIsa(); // カーネルの選択に使う命令セット
+void setCpuIsaLimit(Isa limit); // cpuIsa() を limit 以下にする（比較や問題の切り分け用）
+bool parseIsa(char const *name, Isa *out); // "generic", "sse2", "avx2", "avx512"
+char const *isaName(Isa isa);
+
+} // namespace euclase
+
+#endif // CPU_H
@@ -1,4 +1,45 @@
 #include "euclase.h"
+#include <cstring>
+
+euclase::GammaTable::GammaTable()
+{
+	for (int i = 0; i < 256; i++) {
+		unorm[i] = float(i / 255.0);
+		linear[i] = degamma(unorm[i]);
+	}
+
+	// FPixelRGBA::r8(gamma(v)) と同じ丸めになるよう、境界値を二分探索で求める
+	auto to8 = [](float v){
+		float t = gamma(v);
+		if (t <= 0) return 0;
+		if (t >= 1) return 255;
+		return (int)floor(t * 255 + 0.5);
+	};
+	threshold[0] = 0;
+	for (int k = 1; k < 256; k++) {
+		uint32_t lo = 0;
+		uint32_t hi = 0x3f800000; // 1.0f
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			float v;
+			memcpy(&v, &mid, sizeof(v));
+			if (to8(v) >= k) {
+				hi = mid;
+			} else {
+				lo = mid + 1;
+			}
+		}
+		memcpy(&threshold[k], &lo, sizeof(float));
+	}
+	threshold[256] = 2;
+
+	int k = 0;
+	for (int i = 0; i < 65536; i++) {
+		float v = i / 65535.0f;
+		while (k < 255 && v >= threshold[k + 1]) k++;
+		inverse[i] = k;
+	}
+}
 
 double euclase::cubicBezierPoint(double p0, double p1, double p2, double p3, double t)
 {
@@ -29,6 +29,44 @@ static inline float degamma(float v)
 	return v * v;
 }
 
+// 8bit <-> 浮動小数点の変換テーブル
+struct GammaTable {
+	float unorm[256];       // v / 255
+	float linear[256];      // degamma(v / 255)
+	float threshold[257];   // gamma8() が k 以上を返す最小のリニア値
+	uint8_t inverse[65536]; // リニア値 -> 8bit（近似値。threshold で補正する）
+	GammaTable();
+};
+
+// 最初の呼び出しで作る。ほかの静的オブジェクトの初期化から呼ばれても、作り終わってから返す
+inline GammaTable const &gammaTable()
+{
+	static const GammaTable table;
+	return table;
+}
+
+static inline float unorm(uint8_t v)
+{
+	return gammaTable().unorm[v];
+}
+
+static inline float linear(uint8_t v)
+{
+	return gammaTable().linear[v];
+}
+
+// gamma(v) を 8bit に丸めた値（sqrt を使わない）
+static inline uint8_t gamma8(float v)
+{
+	if (!(v > 0)) return 0;
+	if (v >= 1) return 255;
+	GammaTable const &t = gammaTable();
+	int k = t.inverse[(int)(v * 65535)];
+	while (k < 255 && v >= t.threshold[k + 1]) k++;
+	while (k > 0 && v < t.threshold[k]) k--;
+	return k;
+}
+
 struct PixelGrayA;
 
 struct PixelRGBA {
@@ -105,9 +143,9 @@ public:
 	{
 	}
 	FPixelRGB(PixelRGBA const &src)
-		: r(float(src.r / 255.0))
-		, g(float(src.g / 255.0))
-		, b(float(src.b / 255.0))
+		: r(unorm(src.r))
+		, g(unorm(src.g))
+		, b(unorm(src.b))
 	{
 	}
 	FPixelRGB operator + (FPixelRGB const &right) const
@@ -190,7 +228,7 @@ public:
 	{
 	}
 	FPixelGray(PixelGrayA const &src)
-		: l(src.l / 255.0)
+		: l(unorm(src.l))
 	{
 	}
 	FPixelGray operator + (FPixelGray const &right) const
@@ -262,10 +300,10 @@ public:
 	{
 	}
 	FPixelRGBA(PixelRGBA const &src)
-		: r(float(src.r / 255.0))
-		, g(float(src.g / 255.0))
-		, b(float(src.b / 255.0))
-		, a(float(src.a / 255.0))
+		: r(unorm(src.r))
+		, g(unorm(src.g))
+		, b(unorm(src.b))
+		, a(unorm(src.a))
 	{
 	}
 	FPixelRGBA operator + (FPixelRGBA const &right) const
@@ -364,8 +402,8 @@ public:
 	{
 	}
 	FPixelGrayA(PixelGrayA const &src)
-		: l(float(src.l / 255.0))
-		, a(float(src.a / 255.0))
+		: l(unorm(src.l))
+		, a(unorm(src.a))
 	{
 	}
 	FPixelGrayA operator + (FPixelGrayA const &right) const
@@ -435,6 +473,73 @@ static inline FPixelRGBA degamma(FPixelRGBA const &pix)
 	return FPixelRGBA(degamma(pix.r), degamma(pix.g), degamma(pix.b), pix.a);
 }
 
+// リニア空間で合成するピクセル（変換はテーブルで行う）
+
+class FLinearPixelRGB : public FPixelRGB {
+public:
+	FLinearPixelRGB()
+	{
+	}
+	FLinearPixelRGB(PixelRGBA const &src)
+		: FPixelRGB(linear(src.r), linear(src.g), linear(src.b))
+	{
+	}
+	void add(FLinearPixelRGB const &p, float v)
+	{
+		FPixelRGB::add(p, v);
+	}
+	void sub(FLinearPixelRGB const &p, float v)
+	{
+		FPixelRGB::sub(p, v);
+	}
+	PixelRGBA color(float amount) const
+	{
+		if (amount == 0) {
+			return PixelRGBA(0, 0, 0);
+		}
+		float m = 1 / amount;
+		return PixelRGBA(gamma8(r * m), gamma8(g * m), gamma8(b * m));
+	}
+	operator PixelRGBA () const
+	{
+		return color(1);
+	}
+};
+
+class FLinearPixelRGBA : public FPixelRGBA {
+public:
+	FLinearPixelRGBA()
+	{
+	}
+	FLinearPixelRGBA(PixelRGBA const &src)
+		: FPixelRGBA(linear(src.r), linear(src.g), linear(src.b), unorm(src.a))
+	{
+	}
+	void add(FLinearPixelRGBA const &p, float v)
+	{
+		FPixelRGBA::add(p, v);
+	}
+	void sub(FLinearPixelRGBA const &p, float v)
+	{
+		FPixelRGBA::sub(p, v);
+	}
+	PixelRGBA color(float amount) const
+	{
+		if (amount == 0) {
+			return PixelRGBA(0, 0, 0, 0);
+		}
+		FPixelRGBA pixel(*this);
+		pixel *= (1.0f / pixel.a);
+		pixel.a = pixel.a / amount;
+		pixel.a = clamp(pixel.a, 0.0f, 1.0f);
+		return PixelRGBA(gamma8(pixel.r), gamma8(pixel.g), gamma8(pixel.b), pixel.a8());
+	}
+	operator PixelRGBA () const
+	{
+		return PixelRGBA(gamma8(r), gamma8(g), gamma8(b), a8());
+	}
+};
+
 // cubic bezier curve
 
 double cubicBezierPoint(double p0, double p1, double p2, double p3, double t);
@@ -5,6 +5,8 @@
 #include "AlphaBlend.h"
 #include "SelectionOutlineRenderer.h"
 #include "ImageViewRenderer.h"
+#include "TileStore.h"
+#include "cpu.h"
 
 #include <QDebug>
 
@@ -19,6 +21,26 @@ int main(int argc, char *argv[])
 	qRegisterMetaType<RenderedImage>("RenderedImage");
 	qRegisterMetaType<SelectionOutlineBitmap>("SelectionOutlineBitmap");
 
+	{ // タイルの常駐メモリ上限（MB）。超えた分はスワップファイルへ追い出す
+		bool ok = false;
+		qint64 mb = qgetenv("EUCLASE_TILE_BUDGET_MB").toLongLong(&ok);
+		if (ok && mb > 0) {
+			TileStore::setBudget((size_t)mb * 1024 * 1024);
+		}
+	}
+
+	{ // 画素処理に使う命令セットの上限（generic, sse2, avx2, avx512）
+		QByteArray isa = qgetenv("EUCLASE_ISA");
+		euclase::Isa limit;
+		if (!isa.isEmpty()) {
+			if (euclase::parseIsa(isa.constData(), &limit)) {
+				euclase::setCpuIsaLimit(limit);
+			} else {
+				qDebug() << "EUCLASE_ISA: unknown instruction set" << isa;
+			}
+		}
+	}
+
 	MainWindow w;
 	w.show();
 
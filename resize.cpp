@@ -10,6 +10,8 @@ using FPixelRGB = euclase::FPixelRGB;
 using FPixelGray = euclase::FPixelGray;
 using FPixelRGBA = euclase::FPixelRGBA;
 using FPixelGrayA = euclase::FPixelGrayA;
+using FLinearPixelRGB = euclase::FLinearPixelRGB;
+using FLinearPixelRGBA = euclase::FLinearPixelRGBA;
 
 namespace {
 
@@ -525,9 +527,8 @@ template <typename PIXEL, typename FPIXEL> QImage BlurFilter(QImage image, int r
 	return image;
 }
 
-}
-
-QImage resizeImage(QImage image, int dst_w, int dst_h, EnlargeMethod method, bool alphachannel)
+template <typename RGBA, typename RGB>
+QImage resizeImageT(QImage image, int dst_w, int dst_h, EnlargeMethod method, bool alphachannel)
 {
 	if (dst_w > 0 && dst_h > 0) {
 		int w, h;
@@ -537,21 +538,21 @@ QImage resizeImage(QImage image, int dst_w, int dst_h, EnlargeMethod method, boo
 			if (dst_w < w || dst_h < h) {
 				if (dst_w < w && dst_h < h) {
 					if (alphachannel) {
-						image = resizeAveragingT<FPixelRGBA>(image, dst_w, dst_h);
+						image = resizeAveragingT<RGBA>(image, dst_w, dst_h);
 					} else {
-						image = resizeAveragingT<FPixelRGB>(image, dst_w, dst_h);
+						image = resizeAveragingT<RGB>(image, dst_w, dst_h);
 					}
 				} else if (dst_w < w) {
 					if (alphachannel) {
-						image = resizeAveragingHT<FPixelRGBA>(image, dst_w);
+						image = resizeAveragingHT<RGBA>(image, dst_w);
 					} else {
-						image = resizeAveragingHT<FPixelRGB>(image, dst_w);
+						image = resizeAveragingHT<RGB>(image, dst_w);
 					}
 				} else if (dst_h < h) {
 					if (alphachannel) {
-						image = resizeAveragingVT<FPixelRGBA>(image, dst_h);
+						image = resizeAveragingVT<RGBA>(image, dst_h);
 					} else {
-						image = resizeAveragingVT<FPixelRGB>(image, dst_h);
+						image = resizeAveragingVT<RGB>(image, dst_h);
 					}
 				}
 			}
@@ -561,41 +562,41 @@ QImage resizeImage(QImage image, int dst_w, int dst_h, EnlargeMethod method, boo
 				if (method == EnlargeMethod::Bilinear) {
 					if (dst_w > w && dst_h > h) {
 						if (alphachannel) {
-							image = resizeBilinearT<FPixelRGBA>(image, dst_w, dst_h);
+							image = resizeBilinearT<RGBA>(image, dst_w, dst_h);
 						} else {
-							image = resizeBilinearT<FPixelRGB>(image, dst_w, dst_h);
+							image = resizeBilinearT<RGB>(image, dst_w, dst_h);
 						}
 					} else if (dst_w > w) {
 						if (alphachannel) {
-							image = resizeBilinearHT<FPixelRGBA>(image, dst_w);
+							image = resizeBilinearHT<RGBA>(image, dst_w);
 						} else {
-							image = resizeBilinearHT<FPixelRGB>(image, dst_w);
+							image = resizeBilinearHT<RGB>(image, dst_w);
 						}
 					} else if (dst_h > h) {
 						if (alphachannel) {
-							image = resizeBilinearVT<FPixelRGBA>(image, dst_h);
+							image = resizeBilinearVT<RGBA>(image, dst_h);
 						} else {
-							image = resizeBilinearVT<FPixelRGB>(image, dst_h);
+							image = resizeBilinearVT<RGB>(image, dst_h);
 						}
 					}
 				} else if (method == EnlargeMethod::Bicubic) {
 					if (dst_w > w && dst_h > h) {
 						if (alphachannel) {
-							image = resizeBicubicT<FPixelRGBA>(image, dst_w, dst_h);
+							image = resizeBicubicT<RGBA>(image, dst_w, dst_h);
 						} else {
-							image = resizeBicubicT<FPixelRGB>(image, dst_w, dst_h);
+							image = resizeBicubicT<RGB>(image, dst_w, dst_h);
 						}
 					} else if (dst_w > w) {
 						if (alphachannel) {
-							image = resizeBicubicHT<FPixelRGBA>(image, dst_w);
+							image = resizeBicubicHT<RGBA>(image, dst_w);
 						} else {
-							image = resizeBicubicHT<FPixelRGB>(image, dst_w);
+							image = resizeBicubicHT<RGB>(image, dst_w);
 						}
 					} else if (dst_h > h) {
 						if (alphachannel) {
-							image = resizeBicubicVT<FPixelRGBA>(image, dst_h);
+							image = resizeBicubicVT<RGBA>(image, dst_h);
 						} else {
-							image = resizeBicubicVT<FPixelRGB>(image, dst_h);
+							image = resizeBicubicVT<RGB>(image, dst_h);
 						}
 					}
 				} else {
@@ -608,11 +609,24 @@ QImage resizeImage(QImage image, int dst_w, int dst_h, EnlargeMethod method, boo
 	return QImage();
 }
 
-QImage filter_blur(QImage image, int radius)
+}
+
+QImage resizeImage(QImage image, int dst_w, int dst_h, EnlargeMethod method, bool alphachannel, bool linear)
+{
+	if (linear) {
+		return resizeImageT<FLinearPixelRGBA, FLinearPixelRGB>(image, dst_w, dst_h, method, alphachannel);
+	}
+	return resizeImageT<FPixelRGBA, FPixelRGB>(image, dst_w, dst_h, method, alphachannel);
+}
+
+QImage filter_blur(QImage image, int radius, bool linear)
 {
 	if (image.format() == QImage::Format_Grayscale8) {
 		return BlurFilter<PixelGrayA, FPixelGrayA>(image, radius);
 	}
 	image = image.convertToFormat(QImage::Format_RGBA8888);
+	if (linear) {
+		return BlurFilter<PixelRGBA, FLinearPixelRGBA>(image, radius);
+	}
 	return BlurFilter<PixelRGBA, FPixelRGBA>(image, radius);
 }
@@ -9,6 +9,7 @@ enum class EnlargeMethod {
 	Bicubic,
 };
 
-QImage resizeImage(QImage image, int dst_w, int dst_h, EnlargeMethod method = EnlargeMethod::Bilinear, bool alphachannel = true);
+// linear: リニア空間で補間する（変換はテーブルで行う）
+QImage resizeImage(QImage image, int dst_w, int dst_h, EnlargeMethod method = EnlargeMethod::Bilinear, bool alphachannel = true, bool linear = false);
 
 #endif // IMAGE_H
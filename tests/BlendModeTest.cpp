@@ -0,0 +1,41 @@
+#include "AlphaBlend.h"
+#include "Test.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <vector>
+
+// 合成モード：1行分の合成（8bit ストレート）と合成用バッファ（乗算済み）の結果の比較
+bool testBlendModes()
+{
+	bool ok = true;
+	const int n = 4096;
+	std::vector<Pixel> base(n), over(n), out(n), acc_out(n);
+	std::vector<float> acc(n * 4);
+	Random rnd;
+	for (int i = 0; i < n; i++) {
+		base[i] = Pixel(rnd(), rnd(), rnd(), rnd());
+		over[i] = Pixel(rnd(), rnd(), rnd(), rnd());
+	}
+	for (int i = 0; i <= (int)AlphaBlend::BlendMode::Difference; i++) {
+		const AlphaBlend::BlendMode mode = (AlphaBlend::BlendMode)i;
+		out = base;
+		QElapsedTimer t;
+		t.start();
+		AlphaBlend::span_blend_func(mode)(out.data(), over.data(), nullptr, n, AlphaBlend::GammaMethod::Auto);
+		qint64 t_span = t.nsecsElapsed();
+		std::fill(acc.begin(), acc.end(), 0.0f);
+		AlphaBlend::accumulate_premultiplied(acc.data(), base.data(), 255, n);
+		AlphaBlend::accumulate_premultiplied(acc.data(), over.data(), 255, n, mode);
+		AlphaBlend::store_straight(acc_out.data(), acc.data(), n);
+		int maxdiff = 0;
+		for (int j = 0; j < n; j++) {
+			if (out[j].a == 0) continue;
+			maxdiff = std::max(maxdiff, diff(out[j], acc_out[j]));
+		}
+		qDebug() << "blend mode:" << AlphaBlend::blend_mode_name(mode) << "maxdiff" << maxdiff << (maxdiff <= 1 ? "ok" : "NG")
+				 << "span" << double(t_span) / n << "ns/px";
+		if (maxdiff > 1) ok = false;
+	}
+	return ok;
+}
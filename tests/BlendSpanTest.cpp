@@ -0,0 +1,44 @@
+#include "AlphaBlend.h"
+#include "Test.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <vector>
+
+// スパン合成カーネルとスカラー版の比較
+bool testBlendSpan()
+{
+	bool ok = true;
+	const int n = 4096;
+	std::vector<Pixel> base(n), over(n), ref(n), out;
+	std::vector<uint8_t> msk(n);
+	Random rnd;
+	for (int i = 0; i < n; i++) {
+		base[i] = Pixel(rnd(), rnd(), rnd(), (i & 7) == 0 ? 0 : rnd());
+		over[i] = Pixel(rnd(), rnd(), rnd(), (i & 7) == 1 ? 255 : rnd());
+		msk[i] = rnd();
+	}
+	QElapsedTimer t;
+	t.start();
+	for (int i = 0; i < n; i++) {
+		Pixel c = over[i];
+		c.a = c.a * msk[i] / 255;
+		ref[i] = AlphaBlend::blend_with_gamma_collection(base[i], c);
+	}
+	qint64 t_scalar = t.nsecsElapsed();
+	for (AlphaBlend::GammaMethod method : { AlphaBlend::GammaMethod::Compute, AlphaBlend::GammaMethod::Table }) {
+		out = base;
+		t.restart();
+		AlphaBlend::blend_with_gamma_collection(out.data(), over.data(), msk.data(), n, method);
+		qint64 t_span = t.nsecsElapsed();
+		int maxdiff = 0;
+		for (int i = 0; i < n; i++) {
+			maxdiff = std::max(maxdiff, diff(out[i], ref[i]));
+		}
+		char const *name = method == AlphaBlend::GammaMethod::Table ? "table" : AlphaBlend::span_kernel_name();
+		qDebug() << "blend span:" << name << "maxdiff" << maxdiff << (maxdiff <= 1 ? "ok" : "NG")
+				 << "scalar" << t_scalar / n << "ns/px" << "span" << t_span / n << "ns/px";
+		if (maxdiff > 1) ok = false;
+	}
+	return ok;
+}
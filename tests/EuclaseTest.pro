@@ -0,0 +1,32 @@
+
+QT       += core gui
+
+TARGET = EuclaseTest
+TEMPLATE = app
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+DESTDIR = $$PWD/../_bin
+
+INCLUDEPATH += ..
+
+SOURCES += main.cpp \
+	FixedPointTest.cpp \
+	IsaKernelTest.cpp \
+	BlendModeTest.cpp \
+	RenderPanelBench.cpp \
+	BlendSpanTest.cpp \
+	../AlphaBlend.cpp \
+	../Document.cpp \
+	../TileAllocator.cpp \
+	../TileStore.cpp \
+	../cpu.cpp \
+	../euclase.cpp
+
+HEADERS += Test.h \
+	../AlphaBlend.h \
+	../Document.h \
+	../TileAllocator.h \
+	../TileStore.h \
+	../cpu.h \
+	../euclase.h
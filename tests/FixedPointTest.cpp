@@ -0,0 +1,119 @@
+#include "AlphaBlend.h"
+#include "Test.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <cmath>
+#include <vector>
+
+// 固定小数点（fixed_t）と浮動小数点の比較。8bit の入力は全通り試す
+bool testFixedPoint()
+{
+	using fixed_t = AlphaBlend::fixed_t;
+	bool ok = true;
+
+	// ガンマ：8bit -> リニア -> 8bit が戻ること、gamma8() が floor(255 * sqrt(x) + 0.5) と一致すること
+	{
+		int roundtrip = 0;
+		for (int v = 0; v < 256; v++) {
+			if (fixed_t::degamma(v).gamma8() != v) roundtrip++;
+		}
+		int gamma = 0;
+		for (int32_t x = 0; x <= fixed_t::ONE; x++) {
+			const int ref = (int)floor(sqrt((double)x / fixed_t::ONE) * 255 + 0.5);
+			if (fixed_t::raw(x).gamma8() != ref) gamma++;
+		}
+		qDebug() << "fixed gamma:" << "roundtrip errors" << roundtrip << "gamma8 errors" << gamma << (roundtrip == 0 && gamma == 0 ? "ok" : "NG");
+		if (roundtrip != 0 || gamma != 0) ok = false;
+	}
+
+	// 合成：下地と上のアルファの全組み合わせ x 色の値 256 通り
+	{
+		QElapsedTimer t;
+		t.start();
+		int maxdiff = 0;
+		qint64 count[3] = {};
+		for (int ba = 0; ba < 256; ba++) {
+			for (int oa = 0; oa < 256; oa++) {
+				for (int c = 0; c < 256; c++) {
+					const Pixel base(c, 255 - c, (c * 7) & 255, ba);
+					const Pixel over(255 - c, c, (c * 13) & 255, oa);
+					const int d = diff(AlphaBlend::blend_with_gamma_collection(base, over), AlphaBlend::blend_with_gamma_collection_fixed(base, over));
+					maxdiff = std::max(maxdiff, d);
+					count[std::min(d, 2)]++;
+				}
+			}
+		}
+		qDebug() << "fixed blend:" << "maxdiff" << maxdiff << (maxdiff <= 1 ? "ok" : "NG")
+				 << "exact" << count[0] << "+-1" << count[1] << "worse" << count[2] << t.elapsed() << "ms";
+		if (maxdiff > 1) ok = false;
+	}
+
+	// マスク：アルファとマスクの全組み合わせ
+	{
+		std::vector<Pixel> base(256), over(256), out;
+		std::vector<uint8_t> msk(256);
+		int errors = 0;
+		for (int a = 0; a < 256; a++) {
+			for (int i = 0; i < 256; i++) {
+				base[i] = Pixel(i, 255 - i, 128, 255 - a);
+				over[i] = Pixel(255 - i, i, 64, a);
+				msk[i] = i;
+			}
+			out = base;
+			AlphaBlend::blend_with_gamma_collection(out.data(), over.data(), msk.data(), 256, AlphaBlend::GammaMethod::Fixed);
+			for (int i = 0; i < 256; i++) {
+				Pixel o = over[i];
+				o.a = o.a * msk[i] / 255;
+				if (diff(out[i], AlphaBlend::blend_with_gamma_collection_fixed(base[i], o)) != 0) errors++;
+			}
+		}
+		qDebug() << "fixed mask:" << "errors" << errors << (errors == 0 ? "ok" : "NG");
+		if (errors != 0) ok = false;
+	}
+
+	// 合成モードと合成用バッファ
+	{
+		const int n = 65536;
+		std::vector<Pixel> base(n), over(n), out_float, out_fixed;
+		Random rnd;
+		for (int i = 0; i < n; i++) {
+			base[i] = Pixel(rnd(), rnd(), rnd(), rnd());
+			over[i] = Pixel(rnd(), rnd(), rnd(), rnd());
+		}
+		for (int i = 0; i <= (int)AlphaBlend::BlendMode::Difference; i++) {
+			const AlphaBlend::BlendMode mode = (AlphaBlend::BlendMode)i;
+			out_float = base;
+			out_fixed = base;
+			AlphaBlend::span_blend_func(mode)(out_float.data(), over.data(), nullptr, n, AlphaBlend::GammaMethod::Table);
+			AlphaBlend::span_blend_func(mode)(out_fixed.data(), over.data(), nullptr, n, AlphaBlend::GammaMethod::Fixed);
+			int span = 0;
+			for (int j = 0; j < n; j++) {
+				span = std::max(span, diff(out_float[j], out_fixed[j]));
+			}
+			std::vector<float> acc_float(n * 4);
+			std::vector<fixed_t> acc_fixed(n * 4);
+			AlphaBlend::accumulate_premultiplied(acc_float.data(), base.data(), 255, n);
+			AlphaBlend::accumulate_premultiplied(acc_float.data(), over.data(), 200, n, mode);
+			AlphaBlend::accumulate_premultiplied(acc_fixed.data(), base.data(), 255, n);
+			AlphaBlend::accumulate_premultiplied(acc_fixed.data(), over.data(), 200, n, mode);
+			int acc = 0;
+			for (bool premultiplied : { false, true }) {
+				if (premultiplied) {
+					AlphaBlend::store_premultiplied(out_float.data(), acc_float.data(), n);
+					AlphaBlend::store_premultiplied(out_fixed.data(), acc_fixed.data(), n);
+				} else {
+					AlphaBlend::store_straight(out_float.data(), acc_float.data(), n);
+					AlphaBlend::store_straight(out_fixed.data(), acc_fixed.data(), n);
+				}
+				for (int j = 0; j < n; j++) {
+					acc = std::max(acc, diff(out_float[j], out_fixed[j]));
+				}
+			}
+			qDebug() << "fixed mode:" << AlphaBlend::blend_mode_name(mode) << "span maxdiff" << span << "accumulate maxdiff" << acc
+					 << (span <= 1 && acc <= 1 ? "ok" : "NG");
+			if (span > 1 || acc > 1) ok = false;
+		}
+	}
+	return ok;
+}
@@ -0,0 +1,55 @@
+#include "AlphaBlend.h"
+#include "Test.h"
+#include "cpu.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <cstring>
+#include <vector>
+
+// 命令セットごとのカーネルが汎用版とビット単位で一致するか
+bool testIsaKernels()
+{
+	bool ok = true;
+	const int n = 1 << 18;
+	std::vector<Pixel> base(n), over(n), ref_blend, ref_store;
+	std::vector<uint8_t> msk(n);
+	std::vector<float> acc(n * 4);
+	Random rnd;
+	for (int i = 0; i < n; i++) {
+		base[i] = Pixel(rnd(), rnd(), rnd(), (i & 7) == 0 ? 0 : rnd());
+		over[i] = Pixel(rnd(), rnd(), rnd(), (i & 7) == 1 ? 255 : rnd());
+		msk[i] = rnd();
+		float *p = &acc[i * 4];
+		p[3] = (i & 15) == 0 ? 0 : rnd() / 255.0f;
+		for (int c = 0; c < 3; c++) {
+			p[c] = p[3] * (rnd() / 255.0f);
+		}
+	}
+	const euclase::Isa saved = euclase::cpuIsa();
+	const euclase::Isa detected = euclase::detectedIsa();
+	for (int i = 0; i <= (int)detected; i++) {
+		const euclase::Isa isa = (euclase::Isa)i;
+		euclase::setCpuIsaLimit(isa);
+		std::vector<Pixel> out_blend = base;
+		std::vector<Pixel> out_store(n);
+		QElapsedTimer t;
+		t.start();
+		AlphaBlend::blend_with_gamma_collection(out_blend.data(), over.data(), msk.data(), n - 3, AlphaBlend::GammaMethod::Compute);
+		qint64 t_blend = t.nsecsElapsed();
+		t.restart();
+		AlphaBlend::store_straight(out_store.data(), acc.data(), n - 3);
+		qint64 t_store = t.nsecsElapsed();
+		if (isa == euclase::Isa::Generic) {
+			ref_blend = out_blend;
+			ref_store = out_store;
+		}
+		const bool same = memcmp(out_blend.data(), ref_blend.data(), n * sizeof(Pixel)) == 0
+				&& memcmp(out_store.data(), ref_store.data(), n * sizeof(Pixel)) == 0;
+		qDebug() << "isa:" << euclase::isaName(isa) << (same ? "ok" : "NG")
+				 << "blend" << t_blend / n << "ns/px" << "store" << t_store / n << "ns/px";
+		if (!same) ok = false;
+	}
+	euclase::setCpuIsaLimit(saved);
+	return ok;
+}
@@ -0,0 +1,67 @@
+#include "AlphaBlend.h"
+#include "Document.h"
+#include "Test.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+
+// renderToSinglePanel（組み合わせごとに特殊化した関数を選ぶ）と、画素ごとに分岐する処理の比較（計測のみ）
+bool benchRenderPanel()
+{
+	Document::RenderOption opt;
+	Document::Image rgba;
+	Document::Image gray;
+	Document::Image target;
+	rgba.image_ = QImage(64, 64, QImage::Format_RGBA8888);
+	gray.image_ = QImage(64, 64, QImage::Format_Grayscale8);
+	target.image_ = QImage(64, 64, QImage::Format_RGBA8888);
+	for (int y = 0; y < 64; y++) {
+		Pixel *p = reinterpret_cast<Pixel *>(rgba.image_.scanLine(y));
+		uint8_t *g = gray.image_.scanLine(y);
+		for (int x = 0; x < 64; x++) {
+			p[x] = Pixel(x * 4, y * 4, (x + y) * 2, (x * y) & 255);
+			g[x] = (x * 7 + y * 3) & 255;
+		}
+	}
+	auto generic = [&](QImage const &src, QImage *dst, int opacity){
+		for (int y = 0; y < 64; y++) {
+			Pixel *d = reinterpret_cast<Pixel *>(dst->scanLine(y));
+			for (int x = 0; x < 64; x++) {
+				Pixel c;
+				if (src.format() == QImage::Format_Grayscale8) {
+					c = Pixel(255, 255, 255, opacity * src.constScanLine(y)[x] / 255);
+				} else if (src.format() == QImage::Format_RGBA8888) {
+					c = reinterpret_cast<Pixel const *>(src.constScanLine(y))[x];
+					if (opt.mode == Document::RenderOption::DirectCopy) {
+						d[x] = c;
+						continue;
+					}
+					c.a = c.a * opacity / 255;
+				}
+				d[x] = AlphaBlend::blend_with_gamma_collection(d[x], c);
+			}
+		}
+	};
+	const int N = 200;
+	for (Document::Image const *input : { &rgba, &gray }) {
+		for (int opacity : { 255, 128 }) {
+			QElapsedTimer t;
+			target.image_.fill(Qt::white);
+			t.start();
+			for (int i = 0; i < N; i++) {
+				generic(input->image_, &target.image_, opacity);
+			}
+			qint64 t_generic = t.nsecsElapsed();
+			target.image_.fill(Qt::white);
+			t.restart();
+			for (int i = 0; i < N; i++) {
+				Document::renderToSinglePanel(&target, QPoint(), input, QPoint(), nullptr, opt, QColor(), opacity);
+			}
+			qint64 t_kernel = t.nsecsElapsed();
+			qDebug() << "render panel:" << (input == &rgba ? "RGBA->RGBA" : "Gray8->RGBA") << "opacity" << opacity
+					 << "generic" << double(t_generic) / (N * 64 * 64) << "ns/px"
+					 << "kernel" << double(t_kernel) / (N * 64 * 64) << "ns/px";
+		}
+	}
+	return true;
+}
@@ -0,0 +1,36 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include "euclase.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+// 画素処理のカーネルの検査と計測
+// 検査は誤差が許容範囲に収まれば true を返す。計測だけのものは常に true を返す
+
+using Pixel = euclase::PixelRGBA;
+
+// 毎回同じ並びになる乱数（線形合同法）
+struct Random {
+	uint32_t seed = 1;
+	uint8_t operator () ()
+	{
+		seed = seed * 1103515245 + 12345;
+		return uint8_t(seed >> 16);
+	}
+};
+
+// チャンネルごとの差の最大値
+static inline int diff(Pixel const &a, Pixel const &b)
+{
+	return std::max(std::max(abs(a.r - b.r), abs(a.g - b.g)), std::max(abs(a.b - b.b), abs(a.a - b.a)));
+}
+
+bool testBlendSpan();
+bool testIsaKernels();
+bool benchRenderPanel();
+bool testBlendModes();
+bool testFixedPoint();
+
+#endif // TEST_H
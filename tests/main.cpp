@@ -0,0 +1,14 @@
+#include "Test.h"
+
+#include <QDebug>
+
+// 誤差が許容範囲を超えたものがあれば 0 以外で終わる
+int main()
+{
+	int failed = 0;
+	for (bool (*test)() : { testBlendSpan, testIsaKernels, benchRenderPanel, testBlendModes, testFixedPoint }) {
+		if (!test()) failed++;
+	}
+	qDebug() << (failed == 0 ? "all passed" : "FAILED") << failed;
+	return failed == 0 ? 0 : 1;
+}